@@ -0,0 +1,187 @@
+//============================================================================
+// Name        : EEPROMBackup.cpp
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : Backup and restore of the EEPROM over a serial port
+//============================================================================
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "EEPROMBackup.h"
+#include "EEPROMStore.h"
+
+// offset to beginning of eeprom mileage value array, in EEPROMStore.cpp
+extern int k_start_eeprom_array;
+
+// The constructor
+EEPROMBackup::EEPROMBackup(Stream& port)
+    : _port(port), _length(0), _last_ms(0L), _crc(0)
+{
+}
+
+// gather the bytes of a frame, answer it when it is all there
+bool EEPROMBackup::service()
+{
+    unsigned long now = millis();
+    if (_length > 0 && now - _last_ms >= k_backup_timeout_ms)
+        _length = 0;
+    while (_port.available() > 0)
+    {
+        byte b = _port.read();
+        _last_ms = now;
+        // wait for the start of a frame
+        if (_length == 0 && b != k_backup_sync)
+            continue;
+        _frame[_length++] = b;
+        if (_length < 3)
+            continue;
+        if (_frame[2] > sizeof(_frame) - k_backup_frame_overhead)
+        {
+            _length = 0;
+            sendError(BACKUP_BAD_FRAME);
+            continue;
+        }
+        if (_length == _frame[2] + k_backup_frame_overhead)
+        {
+            bool written = handle();
+            _length = 0;
+            return written;
+        }
+    }
+    return false;
+}
+
+// check the frame, and answer it
+bool EEPROMBackup::handle()
+{
+    byte len = _frame[2];
+    word crc = 0xffff;
+    for (byte i=1; i<3+len; ++i)
+        crc = backupCrc(crc, _frame[i]);
+    if (crc != (_frame[3 + len] | (_frame[4 + len] << 8)))
+    {
+        sendError(BACKUP_BAD_FRAME);
+        return false;
+    }
+
+    const byte* p = _frame + 3;
+    int blocks = (EEPROM.length() + k_backup_block_bytes - 1) / k_backup_block_bytes;
+    int block = (len >= 2) ? (p[0] | (p[1] << 8)) : 0;
+    switch (_frame[1])
+    {
+    case BACKUP_INFO:
+        beginReply(BACKUP_INFO, 6);
+        sendWord(EEPROM.length());
+        send(k_backup_block_bytes);
+        sendWord(k_start_eeprom_array);
+        send(k_eeprom_version);
+        endReply();
+        return false;
+
+    case BACKUP_SUMS:
+    {
+        byte count = (len == 3) ? p[2] : 0;
+        if (len != 3 || count > k_backup_max_sums || block + count > blocks)
+            break;
+        beginReply(BACKUP_SUMS, 3 + 2 * count);
+        sendWord(block);
+        send(count);
+        for (byte i=0; i<count; ++i)
+            sendWord(blockCrc(block + i));
+        endReply();
+        return false;
+    }
+
+    case BACKUP_READ:
+        if (len != 2 || block >= blocks)
+            break;
+        beginReply(BACKUP_READ, 2 + k_backup_block_bytes);
+        sendWord(block);
+        for (byte i=0; i<k_backup_block_bytes; ++i)
+        {
+            int idx = block * k_backup_block_bytes + i;
+            send(idx < EEPROM.length() ? EEPROM.read(idx) : 0);
+        }
+        endReply();
+        return false;
+
+    case BACKUP_WRITE:
+    {
+        if (len != 2 + k_backup_block_bytes || block >= blocks)
+            break;
+        // like update, only the bytes that differ are written
+        byte written = 0;
+        for (byte i=0; i<k_backup_block_bytes; ++i)
+        {
+            int idx = block * k_backup_block_bytes + i;
+            if (idx < EEPROM.length() && EEPROM.read(idx) != p[2 + i])
+            {
+                EEPROM.write(idx, p[2 + i]);
+                ++written;
+            }
+        }
+        beginReply(BACKUP_WRITE, 3);
+        sendWord(block);
+        send(written);
+        endReply();
+        return written > 0;
+    }
+
+    default:
+        sendError(BACKUP_BAD_COMMAND);
+        return false;
+    }
+    sendError(BACKUP_BAD_BLOCK);
+    return false;
+}
+
+// CRC of a block, past the end of the EEPROM counts as 0
+word EEPROMBackup::blockCrc(int block)
+{
+    word crc = 0xffff;
+    for (byte i=0; i<k_backup_block_bytes; ++i)
+    {
+        int idx = block * k_backup_block_bytes + i;
+        crc = backupCrc(crc, idx < EEPROM.length() ? EEPROM.read(idx) : 0);
+    }
+    return crc;
+}
+
+void EEPROMBackup::beginReply(byte cmd, byte len)
+{
+    _port.write(k_backup_sync);
+    _crc = 0xffff;
+    send(cmd);
+    send(len);
+}
+
+void EEPROMBackup::send(byte b)
+{
+    _port.write(b);
+    _crc = backupCrc(_crc, b);
+}
+
+void EEPROMBackup::sendWord(word w)
+{
+    send(w & 0xff);
+    send(w >> 8);
+}
+
+void EEPROMBackup::endReply()
+{
+    word crc = _crc;
+    _port.write(crc & 0xff);
+    _port.write(crc >> 8);
+}
+
+void EEPROMBackup::sendError(byte error)
+{
+    beginReply(BACKUP_ERROR, 1);
+    send(error);
+    endReply();
+}
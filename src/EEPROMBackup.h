@@ -0,0 +1,118 @@
+//============================================================================
+// Name        : EEPROMBackup.h
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : Backup and restore of the EEPROM over a serial port
+//============================================================================
+
+#ifndef EEPROMBACKUP_H_
+#define EEPROMBACKUP_H_
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+// The EEPROM is seen as blocks of k_backup_block_bytes. The host asks
+// for the checksum of each block, then only reads the blocks that hold
+// something to back up, or only sends the blocks that differ from the
+// image to restore. Blocks are written with update, so only the bytes
+// that changed are written. tools/eeprom_backup is the host side.
+//
+// Each message, either way, is a frame: k_backup_sync, the command, the
+// length of the payload, the payload, then the CRC of the command,
+// length and payload. Numbers are little endian. The commands, with the
+// payload sent and the payload of the reply:
+//
+//   BACKUP_INFO   -                 EEPROM length (2), block bytes (1),
+//                                   value array start (2), version (1)
+//   BACKUP_SUMS   first block (2),  first block (2), count (1), the CRC
+//                 count (1)         of each block (2 each)
+//   BACKUP_READ   block (2)         block (2), its bytes
+//   BACKUP_WRITE  block (2), bytes  block (2), bytes written (1)
+//
+// A bad request gets a BACKUP_ERROR reply, with a BackupError. A frame
+// not finished within k_backup_timeout_ms is dropped.
+
+// bytes in a block
+const byte k_backup_block_bytes = 32;
+
+// first byte of a frame
+const byte k_backup_sync = 0xee;
+
+// bytes of a frame besides the payload
+const byte k_backup_frame_overhead = 5;
+
+// most blocks in a BACKUP_SUMS reply
+const byte k_backup_max_sums = 120;
+
+// a partial frame is dropped after this long without a byte
+const unsigned long k_backup_timeout_ms = 100;
+
+enum BackupCommand
+{
+    BACKUP_INFO = 'I',
+    BACKUP_SUMS = 'S',
+    BACKUP_READ = 'R',
+    BACKUP_WRITE = 'W',
+    BACKUP_ERROR = 'E'
+};
+
+enum BackupError
+{
+    BACKUP_BAD_FRAME = 1,
+    BACKUP_BAD_BLOCK,
+    BACKUP_BAD_COMMAND
+};
+
+// CRC-16/CCITT, start from 0xffff
+inline word backupCrc(word crc, byte b)
+{
+    crc ^= static_cast<word>(b) << 8;
+    for (byte i=0; i<8; ++i)
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    return crc;
+}
+
+class EEPROMBackup
+{
+public:
+    explicit EEPROMBackup(Stream& port);
+
+    // call from the loop, answers a request once all of it has arrived.
+    // Returns true when a block was written, the store must then be
+    // started again with begin() before it is used
+    bool service();
+
+private:
+
+    // answer the frame in _frame
+    bool handle();
+
+    // CRC of a block
+    word blockCrc(int block);
+
+    // send a frame, the payload given in pieces
+    void beginReply(byte cmd, byte len);
+    void send(byte b);
+    void sendWord(word w);
+    void endReply();
+
+    void sendError(byte error);
+
+    Stream& _port;
+
+    // the frame being received
+    byte _frame[k_backup_frame_overhead + 2 + k_backup_block_bytes];
+    byte _length;
+
+    // time the last byte arrived
+    unsigned long _last_ms;
+
+    // CRC of the reply being sent
+    word _crc;
+};
+
+#endif /* EEPROMBACKUP_H_ */
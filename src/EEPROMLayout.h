@@ -0,0 +1,454 @@
+//============================================================================
+// Name        : EEPROMLayout.h
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : Decoding of the EEPROM mileage value array
+//============================================================================
+
+#ifndef EEPROMLAYOUT_H_
+#define EEPROMLAYOUT_H_
+
+// The settings log and the mileage value array are described in
+// EEPROMStore.h. The functions here only decode them, and don't care
+// where the bytes come from, so
+// that the store and the host tools share them. A Source is anything
+// returning the byte at an offset with operator[], such as the store's
+// EEPROM reader, or a pointer to an image in memory.
+//
+// Entries are EEPROMSTORE_RING_ENTRY_BYTES (2, 3 or 4) bytes, most
+// significant first, with the end marker in the high bit of the first
+// byte. They are at start, start+bytes, and so on. The last entry used
+// is the first one at or past end-2*bytes, after it the array wraps to
+// start.
+//
+// With 2 byte entries the value is the low 15 bits of the mileage, and
+// the multiplier in the header the bits above them. With 3 or 4 byte
+// entries the value is the whole mileage, and the multiplier isn't
+// used. Wider entries mean fewer updates before the array wraps,
+// and so more wear on each entry, but the header is never rewritten as
+// the mileage grows.
+
+#include <string.h>
+
+#if !defined(EEPROMSTORE_RING_ENTRY_BYTES)
+#define EEPROMSTORE_RING_ENTRY_BYTES 2
+#endif
+
+// The header fields and the setting values are stored packed, with no
+// padding, least significant byte first, and floats as their IEEE single
+// bits, so an image reads the same on AVR, ARM and the host. Packed<T, N>
+// puts a T in N bytes, and gets it back from a Source
+template<typename T, byte N = sizeof(T)>
+struct Packed
+{
+    static const byte size = N;
+
+    static void put(byte* p, T v)
+    {
+        for (byte i=0; i<N; ++i)
+        {
+            p[i] = v & 0xff;
+            v >>= 8;
+        }
+    }
+
+    template<typename Source>
+    static T get(const Source& src, int offset)
+    {
+        T v = 0;
+        for (byte i=N; i>0; --i)
+            v = (v << 8) | src[offset + i - 1];
+        return v;
+    }
+};
+
+template<>
+struct Packed<float, 4>
+{
+    static const byte size = 4;
+
+    static void put(byte* p, float v)
+    {
+        uint32_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        Packed<uint32_t>::put(p, bits);
+    }
+
+    template<typename Source>
+    static float get(const Source& src, int offset)
+    {
+        uint32_t bits = Packed<uint32_t>::get(src, offset);
+        float v;
+        memcpy(&v, &bits, sizeof(v));
+        return v;
+    }
+};
+
+#if EEPROMSTORE_RING_ENTRY_BYTES == 2
+typedef word RingValue;
+#elif EEPROMSTORE_RING_ENTRY_BYTES == 3 || EEPROMSTORE_RING_ENTRY_BYTES == 4
+typedef unsigned long RingValue;
+#else
+#error "EEPROMSTORE_RING_ENTRY_BYTES must be 2, 3 or 4"
+#endif
+
+const byte k_ring_entry_bytes = EEPROMSTORE_RING_ENTRY_BYTES;
+
+// bits of the mileage in an entry, all but the end marker
+const byte k_ring_value_bits = 8 * EEPROMSTORE_RING_ENTRY_BYTES - 1;
+
+// total mileage wraps around to 0 at this value, with 2 byte entries
+// the multiplier holds 8 more bits
+const unsigned long k_mileage_rollover =
+    1UL << (k_ring_value_bits + ((EEPROMSTORE_RING_ENTRY_BYTES == 2) ? 8 : 0));
+
+// The mileage codec, a mileage below k_mileage_rollover to the entry
+// value and the multiplier, and back. Each is a shift or a mask on an
+// unsigned long, so they are constant time and can be constexpr
+
+// entry value of a mileage
+constexpr RingValue ringValue(unsigned long mileage)
+{
+    return mileage & ((1UL << k_ring_value_bits) - 1);
+}
+
+// multiplier of a mileage, 0 with 3 or 4 byte entries
+constexpr byte ringMultiplier(unsigned long mileage)
+{
+    return (EEPROMSTORE_RING_ENTRY_BYTES == 2) ? (mileage >> k_ring_value_bits) & 0xff : 0;
+}
+
+// total mileage of an entry value, given the header multiplier
+constexpr unsigned long ringMileage(byte multiplier, RingValue val)
+{
+    return (EEPROMSTORE_RING_ENTRY_BYTES == 2)
+        ? (static_cast<unsigned long>(multiplier) << k_ring_value_bits) | val
+        : val;
+}
+
+// number of trip counters, such as trip A/B/C, fuel range and service
+// interval. Each has a marker holding the mileage at its last reset
+#if !defined(EEPROMSTORE_TRIPS)
+#define EEPROMSTORE_TRIPS 5
+#endif
+
+// bytes of a trip marker, the mileage at the last reset, little endian
+const byte k_trip_marker_bytes = (EEPROMSTORE_RING_ENTRY_BYTES == 4) ? 4 : 3;
+
+typedef Packed<unsigned long, k_trip_marker_bytes> PackedTripMarker;
+
+// bit set in the first byte of the latest entry
+const byte k_end_marker = 0x80;
+
+// decode the entry at offset, returns true if it has the end marker
+template<typename Source>
+bool ringEntry(const Source& src, int offset, RingValue& val)
+{
+    byte b = src[offset];
+    val = b & ~k_end_marker;
+    for (byte i=1; i<k_ring_entry_bytes; ++i)
+        val = (val << 8) | src[offset + i];
+    return (b & k_end_marker) != 0;
+}
+
+// offset of the entry after the one at offset
+inline int ringNext(int offset, int start, int end)
+{
+    offset += k_ring_entry_bytes;
+    return (offset >= end - k_ring_entry_bytes) ? start : offset;
+}
+
+// offset of the entry before the one at offset
+inline int ringPrev(int offset, int start, int end)
+{
+    if (offset != start)
+        return offset - k_ring_entry_bytes;
+    int last = end - 2 * k_ring_entry_bytes - start;
+    return start + k_ring_entry_bytes * ((last + k_ring_entry_bytes - 1) / k_ring_entry_bytes);
+}
+
+// carry on looking for the first entry with the end marker from offset,
+// reading at most max_bytes, but always at least one entry. Returns true
+// when the scan is over, with offset at the entry found, or past the last
+// entry if there is none
+template<typename Source>
+bool scanRingStep(const Source& src, int end, int& offset, int max_bytes, RingValue& val)
+{
+    for (int n = 0; offset + k_ring_entry_bytes <= end; offset += k_ring_entry_bytes)
+    {
+        if (n > 0 && n + k_ring_entry_bytes > max_bytes)
+            return false;
+        n += k_ring_entry_bytes;
+        if (ringEntry(src, offset, val))
+            return true;
+    }
+    val = 0;
+    return true;
+}
+
+// find the first entry with the end marker. Returns false if there is
+// none, which is the case for a blank array
+template<typename Source>
+bool scanRing(const Source& src, int start, int end, int& offset, RingValue& val)
+{
+    offset = start;
+    scanRingStep(src, end, offset, end, val);
+    return offset + k_ring_entry_bytes <= end;
+}
+
+// multiplier of the latest entry, at offset latest. With 2 byte entries
+// the header holds the multiplier with the offset of the first entry
+// written with it, from, and when it changes the entry is written before
+// the multiplier. So a latest entry that isn't above the one before it,
+// and isn't the one the multiplier is from, was written with the
+// multiplier one more, which a power loss kept from being written. A
+// write that adds 0x8000 or more at once isn't covered
+template<typename Source>
+byte latestMultiplier(const Source& src, int start, int end, int latest,
+                      byte multiplier, int from)
+{
+    RingValue val, before;
+    ringEntry(src, latest, val);
+    ringEntry(src, ringPrev(latest, start, end), before);
+    if (EEPROMSTORE_RING_ENTRY_BYTES == 2 && latest != from && val <= before)
+        return multiplier + 1;
+    return multiplier;
+}
+
+// Walks the values in the array from the latest back, or from the oldest
+// forward, decoding each entry as it is reached. The walk back ends at an
+// entry that isn't below the one after it, where the array was last
+// wrapped over or the mileage was set back, at a blank entry, or once
+// every entry has been seen. With 2 byte entries an entry whose value
+// isn't below the one after it was written with the multiplier one less.
+// A blank entry reads as 0, as does a value written at a multiple of
+// 0x8000, so a 0 is only taken as a value when it has the multiplier of
+// the one after it, and that is above 0. first() walks all the way back,
+// so it reads the whole array.
+template<typename Source>
+class RingHistory
+{
+public:
+    // latest is the offset of the entry with the end marker, multiplier
+    // the one it was written with
+    RingHistory(const Source& src, int start, int end, int latest, byte multiplier)
+        : _src(src), _start(start), _end(end), _latest(latest),
+          _latest_multiplier(multiplier)
+    {
+        last();
+    }
+
+    // go to the latest value, returns false if there is none
+    bool last()
+    {
+        RingValue val;
+        _valid = ringEntry(_src, _latest, val);
+        _offset = _latest;
+        _multiplier = _latest_multiplier;
+        _mileage = ringMileage(_multiplier, val);
+        _back = 0;
+        return _valid;
+    }
+
+    // go to the oldest value, returns false if there is none
+    bool first()
+    {
+        if (!last())
+            return false;
+        while (prev())
+            ;
+        return true;
+    }
+
+    // go to the value before, returns false, and stays put, at the oldest
+    bool prev()
+    {
+        if (!_valid || _back + 1 >= entries())
+            return false;
+        int offset = ringPrev(_offset, _start, _end);
+        RingValue val;
+        ringEntry(_src, offset, val);
+        byte multiplier = _multiplier;
+        unsigned long mileage = ringMileage(multiplier, val);
+        if (val == 0 && (multiplier == 0 || mileage >= _mileage))
+            return false;
+#if EEPROMSTORE_RING_ENTRY_BYTES == 2
+        if (mileage >= _mileage && multiplier > 0)
+            mileage = ringMileage(--multiplier, val);
+#endif
+        if (mileage >= _mileage)
+            return false;
+        _offset = offset;
+        _multiplier = multiplier;
+        _mileage = mileage;
+        ++_back;
+        return true;
+    }
+
+    // go to the value after, returns false, and stays put, at the latest
+    bool next()
+    {
+        if (!_valid || _back == 0)
+            return false;
+        _offset = ringNext(_offset, _start, _end);
+        RingValue val;
+        ringEntry(_src, _offset, val);
+        unsigned long mileage = ringMileage(_multiplier, val);
+#if EEPROMSTORE_RING_ENTRY_BYTES == 2
+        if (mileage <= _mileage)
+            mileage = ringMileage(++_multiplier, val);
+#endif
+        _mileage = mileage;
+        --_back;
+        return true;
+    }
+
+    // the mileage of the value, and the offset of its entry
+    unsigned long mileage() const { return _mileage; }
+    int offset() const { return _offset; }
+
+    // number of values before the latest one
+    int back() const { return _back; }
+
+private:
+    int entries() const
+    {
+        return (_end - k_ring_entry_bytes - _start + k_ring_entry_bytes - 1) / k_ring_entry_bytes;
+    }
+
+    Source _src;
+    int _start;
+    int _end;
+    int _latest;
+    byte _latest_multiplier;
+
+    // the value the walk is at
+    int _offset;
+    byte _multiplier;
+    unsigned long _mileage;
+    int _back;
+    bool _valid;
+};
+
+// The settings log is a sequence of records, a key byte, a length byte
+// and the value. A key of KEY_END, or anything not a valid record, ends
+// the log. The latest record with a key holds its value.
+
+// keys of the settings log records
+enum SettingKey
+{
+    KEY_END = 0,
+    KEY_FLAGS,
+    KEY_RPM_RANGE,
+    KEY_CONTRAST,
+    KEY_BACKLIGHT,
+    KEY_VOLTAGE_OFFSET,
+    KEY_VOLTAGE_CORRECTION,
+    KEY_SPEEDO_CORRECTION,
+    // one key for each trip marker
+    KEY_TRIP,
+    KEY_COUNT = KEY_TRIP + EEPROMSTORE_TRIPS
+};
+
+// bytes in the settings log, offsets in it fit in a byte. The log is
+// kept in two halves, each starting with a sequence number. The one in
+// use has the newer number, the log is compacted into the other one
+const byte k_settings_log_bytes = 254;
+const byte k_settings_half_bytes = k_settings_log_bytes / 2;
+
+// bytes of a record besides the value
+const byte k_setting_overhead = 2;
+
+// size of the value of a setting
+constexpr byte settingSize(byte key)
+{
+    return (key == KEY_FLAGS || key == KEY_CONTRAST) ? Packed<byte>::size :
+        (key == KEY_RPM_RANGE || key == KEY_BACKLIGHT) ? Packed<word>::size :
+        (key == KEY_VOLTAGE_OFFSET || key == KEY_VOLTAGE_CORRECTION
+         || key == KEY_SPEEDO_CORRECTION) ? Packed<float>::size :
+        PackedTripMarker::size;
+}
+
+// bytes of a record of each key from key on, what the log holds after
+// it is compacted
+constexpr int settingsRecordBytes(byte key = KEY_FLAGS)
+{
+    return (key >= KEY_COUNT) ? 0 :
+        k_setting_overhead + settingSize(key) + settingsRecordBytes(key + 1);
+}
+
+// after compacting, the latest records fill at most half of the half
+// they are in, so that there are as many bytes of changes as of records
+// between compactions, and the sequence numbers aren't written much more
+// than any other cell
+static_assert(2 * settingsRecordBytes() <= k_settings_half_bytes - 1,
+              "settings log too small for a record of each key, lower EEPROMSTORE_TRIPS");
+
+// the sequence number of the half compacted into after one of seq, 0
+// marks a half not in use
+inline byte nextSettingsSeq(byte seq)
+{
+    return (seq == 0xff) ? 1 : seq + 1;
+}
+
+// offset in the log of the half in use. Both have a number while the
+// old one hasn't been cleared after compacting, the newer one is in use
+template<typename Source>
+byte settingsHalf(const Source& src, int start)
+{
+    byte first = src[start];
+    byte second = src[start + k_settings_half_bytes];
+    if (second != 0 && (first == 0 || second == nextSettingsSeq(first)))
+        return k_settings_half_bytes;
+    return 0;
+}
+
+// offset in the log of the end of the half that head is in, the head is
+// never at the sequence number
+inline byte settingsHalfEnd(byte head)
+{
+    return (head > k_settings_half_bytes) ? k_settings_log_bytes :
+        k_settings_half_bytes;
+}
+
+// read the settings log at start. Fills index with the offset in the log
+// of the latest value of each key, 0 if there is none, and returns the
+// offset of the end of the log
+template<typename Source>
+byte scanSettings(const Source& src, int start, byte index[KEY_COUNT])
+{
+    for (byte key=0; key<KEY_COUNT; ++key)
+        index[key] = 0;
+    byte off = settingsHalf(src, start) + 1;
+    byte end = settingsHalfEnd(off);
+    while (off + k_setting_overhead <= end)
+    {
+        byte key = src[start + off];
+        if (key == KEY_END || key >= KEY_COUNT)
+            break;
+        byte len = src[start + off + 1];
+        if (len != settingSize(key) || off + k_setting_overhead + len > end)
+            break;
+        index[key] = off + k_setting_overhead;
+        off += k_setting_overhead + len;
+    }
+    return off;
+}
+
+// decode the trip marker at offset
+template<typename Source>
+unsigned long tripMarker(const Source& src, int offset)
+{
+    return PackedTripMarker::get(src, offset);
+}
+
+// distance since a trip marker, allowing for the mileage rolling over
+inline unsigned long tripDistance(unsigned long mileage, unsigned long marker)
+{
+    if (mileage < marker)
+        return mileage + k_mileage_rollover - marker;
+    return mileage - marker;
+}
+
+#endif /* EEPROMLAYOUT_H_ */
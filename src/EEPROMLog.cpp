@@ -0,0 +1,151 @@
+//============================================================================
+// Name        : EEPROMLog.cpp
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : Diagnostic messages of the EEPROM Store
+//============================================================================
+
+#include <string.h>
+
+#include "EEPROMLog.h"
+
+#if !defined(EEPROMSTORE_BINARY_LOG)
+// the formats, and the table of them, are kept in flash
+#define EEPROMSTORE_LOG_FORMAT(id, fmt) static const char k_format_##id[] PROGMEM = fmt;
+EEPROMSTORE_LOG_MESSAGES(EEPROMSTORE_LOG_FORMAT)
+#undef EEPROMSTORE_LOG_FORMAT
+
+#define EEPROMSTORE_LOG_FORMAT(id, fmt) k_format_##id,
+static const char* const k_log_formats[] PROGMEM =
+{
+    EEPROMSTORE_LOG_MESSAGES(EEPROMSTORE_LOG_FORMAT)
+};
+#undef EEPROMSTORE_LOG_FORMAT
+#endif
+
+EEPROMLog StoreLog;
+
+// The constructor
+EEPROMLog::EEPROMLog()
+    : _quiet(false)
+#if defined(EEPROMSTORE_BINARY_LOG)
+    , _head(0), _tail(0), _dropped(0L)
+#endif
+{
+}
+
+// drop messages while on
+bool EEPROMLog::quiet(bool on)
+{
+    bool was = _quiet;
+    _quiet = on;
+    return was;
+}
+
+// log a message, as text or as a record
+void EEPROMLog::message(byte id, const LogArg* args, byte nargs)
+{
+    if (_quiet)
+        return;
+#if defined(EEPROMSTORE_BINARY_LOG)
+    record(id, args, nargs);
+#else
+    byte a = 0;
+    const char* p = static_cast<const char*>(pgm_read_ptr(&k_log_formats[id]));
+    for (char c; (c = pgm_read_byte(p)) != 0; ++p)
+    {
+        if (c != '%' || a >= nargs)
+        {
+            Serial.write(c);
+            continue;
+        }
+        switch (pgm_read_byte(++p))
+        {
+        case 'x':
+            Serial.print(static_cast<unsigned long>(args[a++].i), HEX);
+            break;
+        case 'f':
+            Serial.print(args[a++].f, 6);
+            break;
+        default:
+            Serial.print(args[a++].i, DEC);
+            break;
+        }
+    }
+    Serial.println();
+#endif
+}
+
+#if defined(EEPROMSTORE_BINARY_LOG)
+// store a record of a message, only called from the main loop
+void EEPROMLog::record(byte id, const LogArg* args, byte nargs)
+{
+    if (space() < 1 + 4 * nargs)
+    {
+        ++_dropped;
+        return;
+    }
+    byte head = _head;
+    _buffer[head] = id;
+    head = (head + 1) % k_buffer_size;
+    for (byte a=0; a<nargs; ++a)
+    {
+        // the low 4 bytes of either member, on a little endian cpu
+        uint32_t v;
+        memcpy(&v, &args[a], 4);
+        for (byte i=0; i<4; ++i)
+        {
+            _buffer[head] = v & 0xff;
+            head = (head + 1) % k_buffer_size;
+            v >>= 8;
+        }
+    }
+    // publish the whole record at once
+    _head = head;
+}
+
+// bytes of records waiting to be sent
+byte EEPROMLog::available()
+{
+    return (_head + k_buffer_size - _tail) % k_buffer_size;
+}
+
+// space left, one byte is kept free to tell a full buffer from an empty one
+byte EEPROMLog::space()
+{
+    return k_buffer_size - 1 - available();
+}
+
+// take the next byte of the records
+byte EEPROMLog::read()
+{
+    byte b = _buffer[_tail];
+    _tail = (_tail + 1) % k_buffer_size;
+    return b;
+}
+
+// send waiting bytes that fit in the serial transmit buffer
+void EEPROMLog::drain()
+{
+    int room = Serial.availableForWrite();
+    while (room-- > 0 && available() > 0)
+        Serial.write(read());
+}
+
+// number of records that didn't fit in the buffer
+unsigned long EEPROMLog::dropped()
+{
+    return _dropped;
+}
+#else
+// text is printed as it is logged, there is nothing waiting
+void EEPROMLog::drain()
+{
+}
+
+unsigned long EEPROMLog::dropped()
+{
+    return 0L;
+}
+#endif
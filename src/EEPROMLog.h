@@ -0,0 +1,152 @@
+//============================================================================
+// Name        : EEPROMLog.h
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : Diagnostic messages of the EEPROM Store
+//============================================================================
+
+#ifndef EEPROMLOG_H_
+#define EEPROMLOG_H_
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+// The store's diagnostic messages are listed here, each with an id and
+// a format. In a format %d prints an argument in decimal, %x in hex and
+// %f as a float with 6 places. Every message ends the line. The formats
+// are kept in flash, so they take no RAM.
+//
+// By default messages are formatted and printed on the serial port as
+// they happen. If EEPROMSTORE_BINARY_LOG is defined, a message is
+// instead stored as a binary record in a RAM buffer, one byte of id
+// followed by 4 little endian bytes per argument, floats as IEEE
+// single. The sketch calls StoreLog.drain() from its loop, which hands
+// the serial port only as many bytes as its transmit buffer has room
+// for, so the transmit interrupt sends them without blocking. A record
+// that does not fit in the buffer is dropped whole. tools/eeprom_logdecode
+// turns the records back into text using this table.
+
+// define to log binary records instead of text
+//#define EEPROMSTORE_BINARY_LOG
+
+#define EEPROMSTORE_LOG_MESSAGES(X)                                     \
+    X(LOG_EEPROM_SIZE, "EEPROM size:%d")                                \
+    X(LOG_HEADER_VERSION, "EEPROM Header version:%d")                   \
+    X(LOG_REINITIALIZED, "Reinitialized EEPROM as it was formatted incorrectly") \
+    X(LOG_HEADER, "EEPROM Header [flags:0x%x rpm range:%d contrast:%d multiplier:%d backlight:%d]") \
+    X(LOG_SETTINGS, "settings log:%d bytes")                            \
+    X(LOG_CORRECTIONS, "[volt off:%f volt corr:%f speed corr:%f]")      \
+    X(LOG_TRIP, "trip%d marker:%d")                                     \
+    X(LOG_WRITE_MILEAGE, "writeMileage")                                \
+    X(LOG_WRITE_SKIP, " - skip")                                        \
+    X(LOG_ROLLOVER, "### rollover ###")                                 \
+    X(LOG_WRITE_VALUE, "mileage:%d mult:%d val:%d")                    \
+    X(LOG_SCAN_START, "Scan eeprom for end marker at offset:%d")        \
+    X(LOG_BLANK_MILEAGE, "blank mileage")                               \
+    X(LOG_WRITE_OFFSET, "write offset:%d latest:%d")                    \
+    X(LOG_READ_MILEAGE, "readMileage:%d")                               \
+    X(LOG_UPDATE_HEADER, "updateHeader")                                \
+    X(LOG_INITIALIZE, "initializeEEPROM")                               \
+    X(LOG_WRITE_LATEST, "writeLatestEEPROM")                            \
+    X(LOG_SET_MILEAGE, "Set mileage to:%d")                             \
+    X(LOG_MIGRATED, "Moved the settings and mileage of version 0 EEPROM") \
+    X(LOG_MULTIPLIER, "Wrote the multiplier a power loss cut short")
+
+#define EEPROMSTORE_LOG_ID(id, fmt) id,
+enum EEPROMLogId
+{
+    EEPROMSTORE_LOG_MESSAGES(EEPROMSTORE_LOG_ID)
+    LOG_MESSAGE_COUNT
+};
+#undef EEPROMSTORE_LOG_ID
+
+// an argument of a message, as stored in a record
+union LogArg
+{
+    LogArg(int v) : i(v) {}
+    LogArg(unsigned int v) : i(v) {}
+    LogArg(long v) : i(v) {}
+    LogArg(unsigned long v) : i(v) {}
+    LogArg(unsigned char v) : i(v) {}
+    LogArg(unsigned short v) : i(v) {}
+    LogArg(float v) : f(v) {}
+    LogArg(double v) : f(v) {}
+
+    long i;
+    float f;
+};
+
+// bytes of a record with nargs arguments
+constexpr int logRecordBytes(byte nargs)
+{
+    return 1 + 4 * nargs;
+}
+
+class EEPROMLog
+{
+public:
+    explicit EEPROMLog();
+
+    // size of the record buffer, it holds the records of begin()
+    static const byte k_buffer_size = 128;
+
+    // log a message, as text or as a record
+    void message(byte id, const LogArg* args, byte nargs);
+
+    // send waiting bytes that fit in the serial transmit buffer, does
+    // nothing when the messages are text
+    void drain();
+
+    // drop messages while on, returns the setting before
+    bool quiet(bool on);
+
+    // number of records that didn't fit in the buffer
+    unsigned long dropped();
+
+#if defined(EEPROMSTORE_BINARY_LOG)
+    // store a record of a message
+    void record(byte id, const LogArg* args, byte nargs);
+
+    // bytes of records waiting to be sent
+    byte available();
+
+    // take the next byte of the records
+    byte read();
+#endif
+
+private:
+
+    bool _quiet;
+
+#if defined(EEPROMSTORE_BINARY_LOG)
+    // space left in the buffer
+    byte space();
+
+    // the buffer takes RAM only in a build with binary records
+    volatile byte _head;
+    volatile byte _tail;
+    byte _buffer[k_buffer_size];
+    unsigned long _dropped;
+#endif
+};
+
+extern EEPROMLog StoreLog;
+
+// log a message from the table, with its arguments
+inline void storeLog(byte id)
+{
+    StoreLog.message(id, 0, 0);
+}
+
+template<typename... Args>
+void storeLog(byte id, Args... args)
+{
+    LogArg a[] = { LogArg(args)... };
+    StoreLog.message(id, a, sizeof...(Args));
+}
+
+#endif /* EEPROMLOG_H_ */
@@ -13,11 +13,15 @@
 #endif
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "EEPROMStore.h"
+#include "EEPROMLayout.h"
+#include "EEPROMLog.h"
 
 // offset to beginning of eeprom mileage value array
-int k_start_eeprom_array = sizeof(struct EEPROMHeader);
+int k_start_eeprom_array = k_ring_start;
 
 #if defined(__AVR_ATmega644__) || defined(__AVR_ATmega644P__)
   int k_end_of_eeprom = 2048;
@@ -30,379 +34,712 @@ int k_start_eeprom_array = sizeof(struct EEPROMHeader);
 
 // The constructor
 EEPROMStore::EEPROMStore()
-    : _latest_offset(0), _latest_val(0), _mileage(0L), _written_mileage(0L)
+    : _multiplier(0), _latest_offset(0), _scanning(false), _mileage(0L),
+      _policy_units(0L), _policy_ms(0L), _policy_start_ms(0L),
+      _added(0L), _added_seq(0), _folded(0L)
 {
     resetHeader();
+#if defined(EEPROMSTORE_STATS)
+    resetStats();
+#endif
+#if defined(EEPROMSTORE_TRACE)
+    _trace_hook = 0;
+    _trace_ms = _trace_added = 0L;
+#endif
 }
 
 void EEPROMStore::begin()
 {
     //initializeEEPROM();
-    readEEPROMHeader();
-    readMileage();
+    beginStart();
+    finishBegin();
 }
 
-void EEPROMStore::resetHeader()
-{
-    _header.version = 0;
-    _header.flags = 0;
-    _header.rpm_range = 12000;
-    _header.contrast = 50;
-    _header.multiplier = 0;
-    _header.backlight_hi = 0;
-    _header.backlight_lo = 128;
-    _header.voltage_offset = 0.0;
-    _header.voltage_correction = 1.0;
-    _header.speedo_correction = 1.0;
-    _header.trip1.multiplier = 0;
-    _header.trip1.marker = 0;
-    _header.trip2.multiplier = 0;
-    _header.trip2.marker = 0;
-}
-
-// read the header field from the EEPROM
-// this contains rarely written values
-void EEPROMStore::readEEPROMHeader()
+// read the header and settings, and start the scan of the value array
+void EEPROMStore::beginStart()
 {
-    Serial.print("EEPROM size:");
-    Serial.println(EEPROM.length(), DEC);
-
-    EEPROM.get(0, _header);
+    trace(TRACE_BEGIN);
+    readEEPROMHeader();
+    storeLog(LOG_SCAN_START, k_start_eeprom_array);
+    _latest_offset = k_start_eeprom_array;
+    _scanning = true;
+}
 
-    Serial.print("EEPROM Header version:");
-    Serial.println(_header.version, DEC);
-    if (_header.version != 0)
+// scan part of the EEPROM value array for the latest mileage value
+bool EEPROMStore::beginStep(int max_bytes)
+{
+    if (!_scanning)
+        return true;
+#if defined(EEPROMSTORE_STATS)
+    unsigned long reads_before = _stats.reads;
+#endif
+    RingValue val;
+    bool done = scanRingStep(EEPROMSource(*this), k_end_of_eeprom,
+                             _latest_offset, max_bytes, val);
+#if defined(EEPROMSTORE_STATS)
+    _stats.boot_scan_bytes += _stats.reads - reads_before;
+#endif
+    if (!done)
+        return false;
+    _scanning = false;
+    if (_latest_offset + k_ring_entry_bytes <= k_end_of_eeprom)
     {
-        initializeEEPROM();
-        Serial.println("Reinitialized EEPROM as it was formatted incorrectly");
+        // a power loss can have kept the multiplier of the latest entry
+        // from being written, if so write it now
+        byte multiplier = latestMultiplier(EEPROMSource(*this), k_start_eeprom_array,
+                                           k_end_of_eeprom, _latest_offset,
+                                           _multiplier, multiplierFrom());
+        if (multiplier != _multiplier)
+        {
+            storeLog(LOG_MULTIPLIER);
+            _multiplier = multiplier;
+            writeMultiplier(_latest_offset);
+        }
+        // the next value goes in the entry after the latest
+        _latest_offset = ringNext(_latest_offset, k_start_eeprom_array, k_end_of_eeprom);
     }
+    else
+    {
+        // special case is EEPROM all 0, no values written yet
+        _latest_offset = k_start_eeprom_array;
+#if defined(SERIAL_DEBUG_MSG)
+        storeLog(LOG_BLANK_MILEAGE);
+#endif
+    }
+    storeLog(LOG_WRITE_OFFSET, _latest_offset, val);
+    _mileage = ringMileage(_multiplier, val);
+    storeLog(LOG_READ_MILEAGE, _mileage);
+    return true;
+}
 
-    Serial.print("EEPROM Header [flags:0x");
-    Serial.print(_header.flags, HEX);
-    
-    Serial.print(" rpm range:");
-    Serial.print(_header.rpm_range, DEC);
+// finish the steps of begin, the value array can't be written before
+void EEPROMStore::finishBegin()
+{
+    while (!beginStep(k_end_of_eeprom))
+        ;
+}
 
-    Serial.print(" contrast:");
-    Serial.print(_header.contrast, DEC);
+#if defined(EEPROMSTORE_STATS)
+// read a byte from the EEPROM, counting it
+byte EEPROMStore::eepromRead(int idx)
+{
+    unsigned long start = micros();
+    byte b = EEPROM.read(idx);
+    _stats.eeprom_micros += micros() - start;
+    ++_stats.reads;
+    return b;
+}
 
-    Serial.print(" multiplier:");
-    Serial.print(_header.multiplier, DEC);
+// write a byte to the EEPROM, counting it
+void EEPROMStore::eepromWrite(int idx, byte b)
+{
+    unsigned long start = micros();
+    EEPROM.write(idx, b);
+    _stats.eeprom_micros += micros() - start;
+    ++_stats.writes;
+}
 
-    Serial.print(" backlight:");
-    Serial.print((_header.backlight_hi << 8) + _header.backlight_lo, DEC);
-    Serial.println("]");
+// write a byte to the EEPROM only if it differs from what is there
+void EEPROMStore::eepromUpdate(int idx, byte b)
+{
+    if (eepromRead(idx) == b)
+        ++_stats.skipped_updates;
+    else
+        eepromWrite(idx, b);
+}
+#endif
 
-    Serial.print("[volt off:");
-    Serial.print(_header.voltage_offset, 6);
+// the settings log is empty, so every setting has its default
+void EEPROMStore::resetHeader()
+{
+    _multiplier = 0;
+    for (byte key=0; key<KEY_COUNT; ++key)
+        _setting_index[key] = 0;
+    _settings_head = 1;
+    for (byte n=0; n<EEPROMSTORE_TRIPS; ++n)
+        _trip_base[n] = 0;
+}
+
+#if defined(EEPROMSTORE_BINARY_LOG)
+// bytes of the records begin() logs, with the ones of formatting the
+// EEPROM, which are more than those of moving a version 0 EEPROM or of
+// writing a multiplier a power loss kept from being written, before
+// the sketch's loop can drain any of them
+const int k_log_boot_bytes = 2 * logRecordBytes(1) + 3 * logRecordBytes(0)
+    + logRecordBytes(5) + logRecordBytes(1) + logRecordBytes(3)
+    + EEPROMSTORE_TRIPS * logRecordBytes(2)
+    + logRecordBytes(1) + logRecordBytes(0) + logRecordBytes(2)
+    + logRecordBytes(1);
+static_assert(k_log_boot_bytes < EEPROMLog::k_buffer_size,
+              "log buffer can't hold the records of begin()");
+#endif
 
-    Serial.print(" volt corr:");
-    Serial.print(_header.voltage_correction, 6);
+// read the header field from the EEPROM, then find the latest value of
+// each setting in the log
+void EEPROMStore::readEEPROMHeader()
+{
+    storeLog(LOG_EEPROM_SIZE, EEPROM.length());
 
-    Serial.print(" speed corr:");
-    Serial.print(_header.speedo_correction, 6);
-    Serial.println("]");
+    byte version = Packed<byte>::get(EEPROMSource(*this),
+                                     offsetof(EEPROMHeader, version));
+    byte slot = Packed<byte>::get(EEPROMSource(*this),
+                                  offsetof(EEPROMHeader, multiplier_slot));
+    _multiplier = Packed<byte>::get(EEPROMSource(*this), multiplierOffset(slot)
+                                    + offsetof(EEPROMMultiplier, multiplier));
 
-    Serial.print("trip1 multiplier:");
-    Serial.print(_header.trip1.multiplier, DEC);
-    Serial.print(" marker:");
-    Serial.println(_header.trip1.marker, DEC);
+    storeLog(LOG_HEADER_VERSION, version);
+    if (version == 0 && migrateVersion0())
+        storeLog(LOG_MIGRATED);
+    else if (version != k_eeprom_version)
+    {
+        formatEEPROM();
+        storeLog(LOG_REINITIALIZED);
+    }
+    _settings_head = scanSettings(EEPROMSource(*this), k_settings_start,
+                                  _setting_index);
+
+    byte flags = 0;
+    readSetting(KEY_FLAGS, flags);
+    storeLog(LOG_HEADER, flags, rpmRange(), contrast(),
+             _multiplier, backlight());
+    storeLog(LOG_SETTINGS, _settings_head);
+    storeLog(LOG_CORRECTIONS, voltageOffset(), voltageCorrection(),
+             speedoCorrection());
+    for (byte n=0; n<EEPROMSTORE_TRIPS; ++n)
+    {
+        _trip_base[n] = readTripMarker(n);
+        storeLog(LOG_TRIP, n + 1, _trip_base[n]);
+    }
+}
 
-    Serial.print("trip2 multiplier:");
-    Serial.print(_header.trip2.multiplier, DEC);
-    Serial.print(" marker:");
-    Serial.println(_header.trip2.marker, DEC);
+// move the settings and mileage of a version 0 EEPROM to this layout.
+// Everything is read before anything is written. The version is marked
+// invalid first, so a power loss before it is written again has the
+// EEPROM formatted at the next begin, rather than moved again from what
+// is left of it. Only the header, the settings log and the first entry
+// are written before the version, what is left of the old value array
+// is cleared after it
+bool EEPROMStore::migrateVersion0()
+{
+    EEPROMHeaderV0 h;
+    byte* p = reinterpret_cast<byte*>(&h);
+    bool blank = true;
+    for (size_t i=0; i<sizeof(h); ++i)
+    {
+        p[i] = eepromRead(i);
+        if (p[i] != 0)
+            blank = false;
+    }
+    // the latest value as version 0 read it, the first entry with the
+    // high bit set
+    word val = 0;
+    for (int i=sizeof(h); i+1<k_end_of_eeprom; i+=2)
+    {
+        byte b = eepromRead(i);
+        if (b & 0x80)
+        {
+            val = ((b & 0x7f) << 8) | eepromRead(i + 1);
+            blank = false;
+            break;
+        }
+    }
+    if (blank)
+        return false;
+    unsigned long mileage = (h.multiplier * k_v0_step + val) % k_mileage_rollover;
+    unsigned long trip1 = (h.trip1.multiplier * k_v0_step + h.trip1.marker)
+        % k_mileage_rollover;
+    unsigned long trip2 = (h.trip2.multiplier * k_v0_step + h.trip2.marker)
+        % k_mileage_rollover;
+
+    // nothing but the move itself is logged or traced
+    bool quiet = StoreLog.quiet(true);
+#if defined(EEPROMSTORE_TRACE)
+    EEPROMTraceHook hook = _trace_hook;
+    _trace_hook = 0;
+#endif
+    eepromWrite(offsetof(EEPROMHeader, version), 0xff);
+    for (int i=offsetof(EEPROMHeader, multiplier_slot); i<k_settings_start; ++i)
+        eepromUpdate(i, 0);
+    resetHeader();
+    // the first half of the settings log is in use
+    eepromUpdate(k_settings_start, 1);
+    eepromUpdate(k_settings_start + k_settings_half_bytes, 0);
+    writeSetting(KEY_FLAGS, h.flags);
+    writeSetting(KEY_RPM_RANGE, h.rpm_range);
+    writeSetting(KEY_CONTRAST, h.contrast);
+    writeSetting(KEY_BACKLIGHT,
+                 static_cast<word>((h.backlight_hi << 8) | h.backlight_lo));
+    writeSetting(KEY_VOLTAGE_OFFSET, h.voltage_offset);
+    writeSetting(KEY_VOLTAGE_CORRECTION, h.voltage_correction);
+    writeSetting(KEY_SPEEDO_CORRECTION, h.speedo_correction);
+    // the trips version 0 didn't have start at 0
+    for (byte n=0; n<EEPROMSTORE_TRIPS; ++n)
+        setTripMarker(n, (n == 0) ? trip1 : (n == 1) ? trip2 : mileage);
+    _latest_offset = k_start_eeprom_array;
+    writeLatestEEPROM(ringValue(mileage));
+    _mileage = mileage;
+#if EEPROMSTORE_RING_ENTRY_BYTES == 2
+    _multiplier = ringMultiplier(mileage);
+    writeMultiplier(k_start_eeprom_array);
+#endif
+    updateHeader();
+    // the rest of the log and of the value array. A power loss here
+    // leaves old entries, which the history can show, but the first
+    // entry is the one with the end marker, so the mileage is right
+    for (int i=k_settings_start + _settings_head; i<k_ring_start; ++i)
+        eepromUpdate(i, 0);
+    for (int i=k_start_eeprom_array + k_ring_entry_bytes; i<k_end_of_eeprom; ++i)
+        eepromUpdate(i, 0);
+#if defined(EEPROMSTORE_TRACE)
+    _trace_hook = hook;
+#endif
+    StoreLog.quiet(quiet);
+    return true;
 }
 
-// write the header with updated values
+// write the layout version in the header
 void EEPROMStore::updateHeader()
 {
-    Serial.println("updateHeader");
-    EEPROM.put(0, _header);
+    storeLog(LOG_UPDATE_HEADER);
+    byte p[Packed<byte>::size];
+    Packed<byte>::put(p, k_eeprom_version);
+    for (byte i=0; i<sizeof(p); ++i)
+        eepromUpdate(offsetof(EEPROMHeader, version) + i, p[i]);
+#if defined(EEPROMSTORE_STATS)
+    ++_stats.header_flushes;
+#endif
 }
 
-// initialize the eeprom to it's starting state with zero mileage
-void EEPROMStore::initializeEEPROM()
+// write the multiplier to the slot not in use, then switch to it. A
+// power loss before the switch leaves the one in use as it was
+void EEPROMStore::writeMultiplier(int from)
+{
+    storeLog(LOG_UPDATE_HEADER);
+    const int slot_offset = offsetof(EEPROMHeader, multiplier_slot);
+    byte slot = (Packed<byte>::get(EEPROMSource(*this), slot_offset) & 1) ^ 1;
+    EEPROMMultiplier m;
+    Packed<byte>::put(m.multiplier, _multiplier);
+    Packed<word>::put(m.from, from);
+    const byte* p = reinterpret_cast<const byte*>(&m);
+    for (size_t i=0; i<sizeof(m); ++i)
+        eepromUpdate(multiplierOffset(slot) + i, p[i]);
+    eepromUpdate(slot_offset, slot);
+#if defined(EEPROMSTORE_STATS)
+    ++_stats.header_flushes;
+#endif
+}
+
+// offset of the first entry written with the multiplier in use
+int EEPROMStore::multiplierFrom()
 {
-    Serial.println("initializeEEPROM");
-    resetHeader();
-    updateHeader();
-    for (int i=k_start_eeprom_array; i<k_end_of_eeprom; ++i)
-        EEPROM.write(i, 0);
-    _mileage = _written_mileage = 0L;
+    byte slot = Packed<byte>::get(EEPROMSource(*this),
+                                  offsetof(EEPROMHeader, multiplier_slot));
+    return Packed<word>::get(EEPROMSource(*this), multiplierOffset(slot)
+                             + offsetof(EEPROMMultiplier, from));
 }
 
-// read the EEPROM value array to get the latest mileage value
-void EEPROMStore::scanEEPROMForLatest()
+// get the latest value of a setting from the log
+template<typename T>
+bool EEPROMStore::readSetting(byte key, T& value)
 {
-    byte b;
-    _latest_offset = k_start_eeprom_array;
-    Serial.print("Scan eeprom for end marker");
-    Serial.print(" at offset:");
-    Serial.println(_latest_offset, DEC);
-    for (int i=_latest_offset; i<k_end_of_eeprom; ++i)
-    {
-        b = EEPROM.read(i);
-#if defined(SERIAL_DEBUG_MSG)
-        Serial.print("b:");
-        Serial.print(b, HEX);
-        Serial.print(" offset:");
-        Serial.print(i, DEC);
-#endif
-        if ((b & 0x80) == 0)
-        {
-            _latest_val = (b << 8) + EEPROM.read(++i);
-#if defined(SERIAL_DEBUG_MSG)
-            Serial.print(" val:");
-            Serial.println(_latest_val, DEC);
-#endif
-        }
-        else
-        {
-            _latest_val = ((b & 0x7f) << 8) + EEPROM.read(++i);
-            break;
-        }
-        _latest_offset += 2;
-    }
-    // special case is EEPROM all 0, no values written yet
-    if (_latest_offset >= k_end_of_eeprom)
-    {
-        _latest_offset = k_start_eeprom_array;
-        _latest_val = 0;
-#if defined(SERIAL_DEBUG_MSG)
-        Serial.println("\nblank mileage");
-#endif
-    }
-    Serial.print("\nwrite offset:");
-    Serial.print(_latest_offset, DEC);
-    Serial.print(" latest:");
-    Serial.println(_latest_val, DEC);
+    byte off = _setting_index[key];
+    if (off == 0)
+        return false;
+    value = Packed<T>::get(EEPROMSource(*this), k_settings_start + off);
+    return true;
 }
 
-// write a new mileage value, updates the multiplier if need be
-void EEPROMStore::writeLatestEEPROM(word val)
+// pack a setting and append it to the log
+template<typename T>
+void EEPROMStore::writeSetting(byte key, T value)
 {
-#if defined(SERIAL_DEBUG_MSG)
-    Serial.println("writeLatestEEPROM");
+    byte p[Packed<T>::size];
+    Packed<T>::put(p, value);
+    appendSetting(key, p);
+}
+
+// append a record to the settings log, unless the value is the latest
+void EEPROMStore::appendSetting(byte key, const byte* p)
+{
+    byte len = settingSize(key);
+#if defined(EEPROMSTORE_TRACE)
+    // trip markers are traced by the calls that set them
+    if (key < KEY_TRIP)
+    {
+        unsigned long v = 0;
+        for (byte i=len; i>0; --i)
+            v = (v << 8) | p[i - 1];
+        trace(TRACE_SETTING, key, v);
+    }
 #endif
-    _latest_val = val;
-    // check for case where we have are at beginning of eeprom array, don't
-    // need to rewrite the marker byte
-    bool rewrite = true;
-    if (_latest_offset == k_start_eeprom_array)
+    byte off = _setting_index[key];
+    if (off != 0)
     {
-        rewrite = false;
+        byte i = 0;
+        while (i < len && eepromRead(k_settings_start + off + i) == p[i])
+            ++i;
+        if (i == len)
+            return;
     }
-    byte old_marker = rewrite ? EEPROM.read(_latest_offset - 2) : 0;
-    // if the mcu is turned off here before it is able to finish writing we could
-    // get a corrupted flash, so write the new word first, and don't rewrite
-    // the existing marker byte till last. The additional marker byte won't get found
-    // before the existing one if it hasn't yet been overwritten
-    EEPROM.update(_latest_offset++, ((val & 0xff00) >> 8) | 0x80);
-    EEPROM.update(_latest_offset++, val & 0x00ff);
-    // write over the old marker, unless it was at end of eeprom
-    if (rewrite)
+    if (_settings_head + k_setting_overhead + len
+        > settingsHalfEnd(_settings_head))
     {
-        EEPROM.write(_latest_offset - 4, old_marker & 0x7f);
+        compactSettings(key, p);
+        return;
     }
-    // if we've reached the end of eeprom, reset offset
-    if (_latest_offset >= k_end_of_eeprom - 2)
+    _settings_head = writeSettingRecord(_settings_head, key, p);
+}
+
+// write a record at off in the log. The value and length go first, then
+// a terminator past the record, in case a record cut short by a power
+// loss left bytes there, and the key last, which adds the record
+byte EEPROMStore::writeSettingRecord(byte off, byte key, const byte* p)
+{
+    byte len = settingSize(key);
+    int rec = k_settings_start + off;
+    for (byte i=0; i<len; ++i)
+        eepromUpdate(rec + k_setting_overhead + i, p[i]);
+    eepromUpdate(rec + 1, len);
+    byte next = off + k_setting_overhead + len;
+    if (next < settingsHalfEnd(off + 1))
+        eepromUpdate(k_settings_start + next, KEY_END);
+    eepromUpdate(rec, key);
+    _setting_index[key] = off + k_setting_overhead;
+    return next;
+}
+
+// copy the latest record of each other setting to the other half of the
+// log, then the new record of key, and switch to that half by writing its
+// sequence number. A power loss before then leaves the half in use as it
+// was, after it the old half is only cleared
+void EEPROMStore::compactSettings(byte key, const byte* p)
+{
+    byte from = settingsHalfEnd(_settings_head) - k_settings_half_bytes;
+    byte half = k_settings_half_bytes - from;
+    byte seq = eepromRead(k_settings_start + from);
+    eepromUpdate(k_settings_start + half, 0);
+    byte to = half + 1;
+    for (byte k=KEY_FLAGS; k<KEY_COUNT; ++k)
     {
-        _latest_offset = k_start_eeprom_array;
+        byte off = _setting_index[k];
+        if (off == 0 || k == key)
+            continue;
+        int rec = k_settings_start + off - k_setting_overhead;
+        byte size = k_setting_overhead + settingSize(k);
+        for (byte i=0; i<size; ++i)
+            eepromUpdate(k_settings_start + to + i, eepromRead(rec + i));
+        _setting_index[k] = to + k_setting_overhead;
+        to += size;
     }
-#if defined(SERIAL_DEBUG_MSG)
-    Serial.print("write offset:");
-    Serial.print(_latest_offset, DEC);
-    Serial.print(" latest:");
-    Serial.println(_latest_val, DEC);
+    _settings_head = writeSettingRecord(to, key, p);
+    eepromUpdate(k_settings_start + half, nextSettingsSeq(seq));
+    eepromUpdate(k_settings_start + from, 0);
+#if defined(EEPROMSTORE_STATS)
+    ++_stats.settings_compactions;
 #endif
 }
 
-unsigned long EEPROMStore::multiplyMileage(byte multiplier, word val)
+// initialize the eeprom to it's starting state with zero mileage, and
+// no settings
+void EEPROMStore::initializeEEPROM()
 {
-    unsigned long result = multiplier * 0x8fff;
-    result += val;
-    return result;
+    trace(TRACE_INITIALIZE);
+    formatEEPROM();
 }
 
-// find the current mileage stored in EEPROM
-void EEPROMStore::readMileage()
+void EEPROMStore::formatEEPROM()
 {
-    scanEEPROMForLatest();
-    _mileage = multiplyMileage(_header.multiplier, _latest_val);
-    _written_mileage = _mileage;
-    Serial.print("readMileage:");
-    Serial.println(_mileage, DEC);
+    storeLog(LOG_INITIALIZE);
+    resetHeader();
+    updateHeader();
+    // the first multiplier slot is in use, with a multiplier of 0
+    for (int i=offsetof(EEPROMHeader, multiplier_slot); i<k_end_of_eeprom; ++i)
+        eepromWrite(i, 0);
+    // the first half of the settings log is in use
+    eepromWrite(k_settings_start, 1);
+    _latest_offset = k_start_eeprom_array;
+    _mileage = 0L;
 }
 
-// take total mileage and current multiplier, get an updated multiplier and
-// remainder value. Returns true if multiplier was updated
-bool EEPROMStore::collapseMileage(unsigned long mileage, byte& multiplier, word& val)
+// write a new mileage value, updates the multiplier if need be
+void EEPROMStore::writeLatestEEPROM(RingValue val)
 {
-    bool multiplier_changed = false;
-    unsigned long cval = mileage - (multiplier * 0x8fff);
-    while (cval > 0x8fff)
+#if defined(SERIAL_DEBUG_MSG)
+    storeLog(LOG_WRITE_LATEST);
+    storeLog(LOG_WRITE_OFFSET, _latest_offset, val);
+#endif
+    // the previous entry holds the old marker, at the end of the array
+    // if we have wrapped
+    int prev = ringPrev(_latest_offset, k_start_eeprom_array, k_end_of_eeprom);
+    byte old_marker = eepromRead(prev);
+    // if the mcu is turned off here before it is able to finish writing we could
+    // get a corrupted flash, so write the new entry first, and don't rewrite
+    // the existing marker byte till last. The additional marker byte won't get found
+    // before the existing one if it hasn't yet been overwritten
+    for (int i=k_ring_entry_bytes-1; i>0; --i)
     {
-        ++multiplier;
-        multiplier_changed = true;
-        cval -= 0x8fff;
+        eepromUpdate(_latest_offset + i, val & 0xff);
+        val >>= 8;
     }
-    // now that we are under 0x8fff, we can use a word
-    val = cval;
-    return multiplier_changed;
+    eepromUpdate(_latest_offset, val | k_end_marker);
+    // write over the old marker
+    eepromUpdate(prev, old_marker & ~k_end_marker);
+    _latest_offset = ringNext(_latest_offset, k_start_eeprom_array, k_end_of_eeprom);
+#if defined(EEPROMSTORE_STATS)
+    if (_latest_offset == k_start_eeprom_array)
+        ++_stats.ring_wraps;
+#endif
 }
 
 // write the current mileage in the EEPROM, no effect
 // if the value is the same as already stored
 void EEPROMStore::writeMileage()
+{
+    trace(TRACE_WRITE_MILEAGE);
+    storeMileage();
+}
+
+// writeMileage, without a trace record
+void EEPROMStore::storeMileage()
 {
 #if defined(SERIAL_DEBUG_MSG)
-    Serial.println("writeMileage");
+    storeLog(LOG_WRITE_MILEAGE);
 #endif
-    if (_mileage == _written_mileage)
+    finishBegin();
+    unsigned long added = addedMileage();
+    if (added == _folded)
     {
 #if defined(SERIAL_DEBUG_MSG)
-        Serial.println(" - skip");
+        storeLog(LOG_WRITE_SKIP);
 #endif
         return;
     }
-    word newval;
-    byte old_mult = _header.multiplier;
-    if (collapseMileage(_mileage, _header.multiplier, newval))
+    unsigned long mileage = _mileage + (added - _folded);
+    if (mileage >= k_mileage_rollover)
     {
-        // rollover case
-        if (old_mult > _header.multiplier)
-        {
-            _mileage = 0;
-            newval = 0;
+        mileage -= k_mileage_rollover;
 #if defined(SERIAL_DEBUG_MSG)
-            Serial.println("### rollover ###");
+        storeLog(LOG_ROLLOVER);
 #endif
-        }
-        updateHeader();
     }
+    RingValue newval = ringValue(mileage);
 #if defined(SERIAL_DEBUG_MSG)
-    Serial.print("mileage:");
-    Serial.print(_mileage, DEC);
-    Serial.print(" mult:");
-    Serial.print(_header.multiplier, DEC);
-    Serial.print(" val:");
-    Serial.println(newval, DEC);
+    storeLog(LOG_WRITE_VALUE, mileage, ringMultiplier(mileage), newval);
 #endif
-    writeLatestEEPROM(newval);
-    _written_mileage = _mileage;
+#if EEPROMSTORE_RING_ENTRY_BYTES == 2
+    // the header only changes when the mileage passes a multiple of
+    // 0x8000, or rolls over. The entry goes first, until the multiplier
+    // is written begin() reads it as one more, see latestMultiplier
+    if (ringMultiplier(mileage) != _multiplier)
+    {
+        int at = _latest_offset;
+        // a multiplier from this entry would be read as written after it
+        if (multiplierFrom() == at)
+            writeMultiplier(0);
+        writeLatestEEPROM(newval);
+        _multiplier = ringMultiplier(mileage);
+        writeMultiplier(at);
+#if defined(EEPROMSTORE_STATS)
+        ++_stats.multiplier_changes;
+#endif
+    }
+    else
+#endif
+        writeLatestEEPROM(newval);
+    _mileage = mileage;
+    _folded = added;
+}
+
+// set the write policy for service
+void EEPROMStore::setWritePolicy(unsigned long units, unsigned long ms)
+{
+    trace(TRACE_SET_WRITE_POLICY, units, ms);
+    _policy_units = units;
+    _policy_ms = ms;
+    _policy_start_ms = millis();
+}
+
+// write the mileage if the write policy says so
+bool EEPROMStore::service()
+{
+    trace(TRACE_SERVICE);
+    unsigned long pending = addedMileage() - _folded;
+    unsigned long now = millis();
+    // the timer only runs while there is unwritten mileage
+    if (pending == 0)
+    {
+        _policy_start_ms = now;
+        return false;
+    }
+    bool due = (_policy_units != 0 && pending >= _policy_units)
+        || (_policy_ms != 0 && now - _policy_start_ms >= _policy_ms);
+    if (!due)
+        return false;
+    storeMileage();
+    _policy_start_ms = now;
+    return true;
+}
+
+// write the mileage now. writeMileage only writes the value array entry,
+// the old marker and, when the multiplier changes, a multiplier slot and
+// the slot in use, as the header is updated byte by byte
+void EEPROMStore::flush()
+{
+    trace(TRACE_FLUSH);
+    // nothing is logged, printing could wait on the serial port
+    bool quiet = StoreLog.quiet(true);
+    storeMileage();
+    StoreLog.quiet(quiet);
 }
 
-// return the current mileage
+// return the current mileage, the stored mileage and anything added
+// since it was written
 unsigned long EEPROMStore::mileage()
 {
-    return _mileage;
+    return _mileage + (addedMileage() - _folded);
 }
 
 // set the current mileage
 void EEPROMStore::setMileage(unsigned long val)
 {
-    Serial.print("Set mileage to:");
-    Serial.println(val, DEC);
-    _written_mileage = _mileage = val;
-    word newval;
-    byte mult = 0;
-    collapseMileage(_mileage, mult, newval);
-    writeLatestEEPROM(newval);
-    _header.multiplier = mult;
-    _header.trip1.multiplier = _header.trip2.multiplier = mult;
-    _header.trip1.marker = _header.trip2.marker = newval;
-    updateHeader();
+    storeLog(LOG_SET_MILEAGE, val);
+    trace(TRACE_SET_MILEAGE, val);
+    finishBegin();
+    // drop anything added before the new value was set
+    _folded = addedMileage();
+    _mileage = val % k_mileage_rollover;
+    writeLatestEEPROM(ringValue(_mileage));
+#if EEPROMSTORE_RING_ENTRY_BYTES == 2
+    // the multiplier is from this entry, even if it is unchanged, as the
+    // entry may be below the one before it
+    _multiplier = ringMultiplier(_mileage);
+    writeMultiplier(ringPrev(_latest_offset, k_start_eeprom_array, k_end_of_eeprom));
+#endif
+    for (byte n=0; n<EEPROMSTORE_TRIPS; ++n)
+        setTripMarker(n, _mileage);
 }
-    
-// add value to the mileage
+
+// walk the values in the array, from the one before the write offset
+EEPROMStore::History EEPROMStore::history()
+{
+    finishBegin();
+    int latest = ringPrev(_latest_offset, k_start_eeprom_array, k_end_of_eeprom);
+    return History(EEPROMSource(*this), k_start_eeprom_array, k_end_of_eeprom,
+                   latest, _multiplier);
+}
+
+// add value to the mileage. This is the only writer of _added, so it
+// may run in an interrupt handler without any locking
 void EEPROMStore::addMileage(unsigned long val)
 {
-    _mileage += val;
+    _added += val;
+    ++_added_seq;
+}
+
+// take a consistent snapshot of _added. On AVR the 4 byte read can be
+// torn by addMileage running in an interrupt, so repeat the read until
+// the sequence count is unchanged across it
+unsigned long EEPROMStore::addedMileage()
+{
+    unsigned long added;
+    byte seq;
+    do
+    {
+        seq = _added_seq;
+        added = _added;
+    } while (seq != _added_seq);
+    return added;
 }
 
 // get the rpm range
 word EEPROMStore::rpmRange()
 {
-    return _header.rpm_range;
+    word range = 12000;
+    readSetting(KEY_RPM_RANGE, range);
+    return range;
 }
 
 // set the rpm range
 void EEPROMStore::setRPMRange(word range)
 {
-    _header.rpm_range = range;
-    updateHeader();
+    writeSetting(KEY_RPM_RANGE, range);
 }
 
 // get the contrast
 uint8_t EEPROMStore::contrast()
 {
-    return _header.contrast;
+    uint8_t con = 50;
+    readSetting(KEY_CONTRAST, con);
+    return con;
 }
 
 // set the contrast
 void EEPROMStore::setContrast(uint8_t newval)
 {
-    _header.contrast = newval;
-    updateHeader();
+    writeSetting(KEY_CONTRAST, newval);
 }
 
 // get the backlight pwm value
 int EEPROMStore::backlight()
 {
-    return (_header.backlight_hi << 8) + _header.backlight_lo;
+    word bl = 128;
+    readSetting(KEY_BACKLIGHT, bl);
+    return bl;
 }
 
 // set the backlight
 void EEPROMStore::setBacklight(int newval)
 {
-    _header.backlight_hi = static_cast<uint8_t>((newval & 0xff00) >> 8);
-    _header.backlight_lo = static_cast<uint8_t>(newval & 0xff);
-    updateHeader();
+    writeSetting(KEY_BACKLIGHT, static_cast<word>(newval));
 }
 
 // get the voltage offset value
 float EEPROMStore::voltageOffset()
 {
-    return _header.voltage_offset;
+    float off = 0.0;
+    readSetting(KEY_VOLTAGE_OFFSET, off);
+    return off;
 }
 
 // set the voltage offset
 void EEPROMStore::setVoltageOffset(float newval)
 {
-    _header.voltage_offset = newval;
-    updateHeader();
+    writeSetting(KEY_VOLTAGE_OFFSET, newval);
 }
 
 // get the voltage correction value
 float EEPROMStore::voltageCorrection()
 {
-    return _header.voltage_correction;
+    float corr = 1.0;
+    readSetting(KEY_VOLTAGE_CORRECTION, corr);
+    return corr;
 }
 
 // set the voltage correction
 void EEPROMStore::setVoltageCorrection(float newval)
 {
-    _header.voltage_correction = newval;
-    updateHeader();
+    writeSetting(KEY_VOLTAGE_CORRECTION, newval);
 }
 
 // get the speedo correction value
 float EEPROMStore::speedoCorrection()
 {
-    return _header.speedo_correction;
+    float corr = 1.0;
+    readSetting(KEY_SPEEDO_CORRECTION, corr);
+    return corr;
 }
 
 // set the speedo correction
 void EEPROMStore::setSpeedoCorrection(float newval)
 {
-    _header.speedo_correction = newval;
-    updateHeader();
+    writeSetting(KEY_SPEEDO_CORRECTION, newval);
 }
 
 bool EEPROMStore::isMetric()
 {
-    return (_header.flags & METRIC_FLAG) == METRIC_FLAG;
+    byte flags = 0;
+    readSetting(KEY_FLAGS, flags);
+    return (flags & METRIC_FLAG) == METRIC_FLAG;
 }
 
 bool EEPROMStore::isImperial()
@@ -412,53 +749,137 @@ bool EEPROMStore::isImperial()
 
 void EEPROMStore::setMetric()
 {
-    _header.flags |= METRIC_FLAG;
-    updateHeader();
+    byte flags = 0;
+    readSetting(KEY_FLAGS, flags);
+    flags |= METRIC_FLAG;
+    writeSetting(KEY_FLAGS, flags);
 }
 
 void EEPROMStore::setImperial()
 {
-    _header.flags &= ~(METRIC_FLAG);
-    updateHeader();
+    byte flags = 0;
+    readSetting(KEY_FLAGS, flags);
+    flags &= ~(METRIC_FLAG);
+    writeSetting(KEY_FLAGS, flags);
+}
+
+// set a trip marker in the settings log
+void EEPROMStore::setTripMarker(byte n, unsigned long mileage)
+{
+    byte p[PackedTripMarker::size];
+    PackedTripMarker::put(p, mileage);
+    appendSetting(KEY_TRIP + n, p);
+    _trip_base[n] = mileage;
+}
+
+// get a trip marker from the settings log, 0 if it was never set
+unsigned long EEPROMStore::readTripMarker(byte n)
+{
+    byte off = _setting_index[KEY_TRIP + n];
+    if (off == 0)
+        return 0;
+    return tripMarker(EEPROMSource(*this), k_settings_start + off);
+}
+
+// reset a trip counter, only its marker is appended to the log
+void EEPROMStore::resetTrip(byte n)
+{
+    if (n >= EEPROMSTORE_TRIPS)
+        return;
+    trace(TRACE_RESET_TRIP, n);
+    // the marker is the mileage, written first so that it is never ahead
+    // of the mileage read back after a power loss. This also finishes the
+    // scan, which the mileage isn't known before
+    storeMileage();
+    setTripMarker(n, _mileage);
+}
+
+// get the distance on a trip counter, from the marker kept in RAM
+unsigned long EEPROMStore::trip(byte n)
+{
+    if (n >= EEPROMSTORE_TRIPS)
+        return 0;
+    return tripDistance(mileage(), _trip_base[n]);
 }
 
 void EEPROMStore::resetTrip1()
 {
-    word val;
-    byte mult = 0;
-    collapseMileage(_mileage, mult, val);
-    _header.trip1.multiplier = mult;
-    _header.trip1.marker = val;
-    updateHeader();
+    resetTrip(0);
 }
 
 void EEPROMStore::resetTrip2()
 {
-    word val;
-    byte mult = 0;
-    collapseMileage(_mileage, mult, val);
-    _header.trip2.multiplier = mult;
-    _header.trip2.marker = val;
-    updateHeader();
+    resetTrip(1);
 }
 
 unsigned long EEPROMStore::trip1()
 {
-    unsigned long marker_mileage = multiplyMileage(_header.trip1.multiplier,
-                                                   _header.trip1.marker);
-    if (_mileage < marker_mileage)
-        // handle rollover
-        return _mileage + 9436929 - marker_mileage;
-    return _mileage - marker_mileage;
+    return trip(0);
 }
 
 unsigned long EEPROMStore::trip2()
 {
-    unsigned long marker_mileage = multiplyMileage(_header.trip2.multiplier,
-                                                   _header.trip2.marker);
-    if (_mileage < marker_mileage)
-        // handle rollover
-        return _mileage + 9436929 - marker_mileage;
-    else
-        return _mileage - marker_mileage;
+    return trip(1);
+}
+
+#if defined(EEPROMSTORE_STATS)
+const EEPROMStoreStats& EEPROMStore::stats()
+{
+    return _stats;
+}
+
+void EEPROMStore::resetStats()
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void EEPROMStore::printStats()
+{
+    Serial.print(F("stats r:"));
+    Serial.print(_stats.reads, DEC);
+    Serial.print(F(" w:"));
+    Serial.print(_stats.writes, DEC);
+    Serial.print(F(" skip:"));
+    Serial.print(_stats.skipped_updates, DEC);
+    Serial.print(F(" hdr:"));
+    Serial.print(_stats.header_flushes, DEC);
+    Serial.print(F(" cmp:"));
+    Serial.print(_stats.settings_compactions, DEC);
+    Serial.print(F(" wrap:"));
+    Serial.print(_stats.ring_wraps, DEC);
+    Serial.print(F(" mult:"));
+    Serial.print(_stats.multiplier_changes, DEC);
+    Serial.print(F(" scan:"));
+    Serial.print(_stats.boot_scan_bytes, DEC);
+    Serial.print(F(" us:"));
+    Serial.println(_stats.eeprom_micros, DEC);
 }
+#endif
+
+#if defined(EEPROMSTORE_TRACE)
+void EEPROMStore::setTraceHook(EEPROMTraceHook hook)
+{
+    _trace_hook = hook;
+    _trace_ms = millis();
+    _trace_added = addedMileage();
+}
+
+// hand records of the mileage added and the call to the hook
+void EEPROMStore::trace(byte op, unsigned long a, unsigned long b)
+{
+    if (_trace_hook == 0)
+        return;
+    byte rec[k_trace_record_bytes];
+    unsigned long now = millis();
+    unsigned long added = addedMileage();
+    if (added != _trace_added)
+    {
+        _trace_hook(rec, traceRecord(rec, TRACE_ADD_MILEAGE, now - _trace_ms,
+                                     added - _trace_added, 0));
+        _trace_added = added;
+        _trace_ms = now;
+    }
+    _trace_hook(rec, traceRecord(rec, op, now - _trace_ms, a, b));
+    _trace_ms = now;
+}
+#endif
@@ -9,40 +9,111 @@
 #ifndef EEPROMSTORE_H_
 #define EEPROMSTORE_H_
 
+#include <stddef.h>
 #include <EEPROM.h>
 
+#include "EEPROMLayout.h"
+#include "EEPROMTrace.h"
+
 // To save wear and tear on the eeprom, write mileage values to the
 // eeprom in sequence. At the starting offset, write 2 byte pairs
 // which contain the mileage value. After the latest mileage, write
 // one byte with the high bit set to indicate end of updates.  When
 // reading the sequence of values, as soon as the marker byte is read,
 // the last value is the current mileage Since we are writing 2 byte
-// values with the hi bit reserved, the maximum mileage stored is 0x8fff
-// or 36863. To allow the mileage to accumulate more than this, we use
-// a byte in the header, to store how many iterations of the max
-// number are used. If the header byte is 0, then the mileage is the
-// value stored, if it is 1, then add 36863 to the value stored, and
-// so on. This allows for a maximum mileage of 9,436,928. Once this
-// value is reached, it will roll over and start from 0 again.
+// values with the hi bit reserved, the maximum mileage stored is 0x7fff
+// or 32767. To allow the mileage to accumulate more than this, we use
+// a byte in the header, to store the bits of the mileage above those
+// 15. If the header byte is 0, then the mileage is the value stored,
+// if it is 1, then add 32768 to the value stored, and so on. This
+// allows for a maximum mileage of 8,388,607. Once this value is
+// passed, it will roll over and start from 0 again.
 //
 // To write a new mileage, write the new value at the current
 // write offset, then write the marker byte (hi bit set) following.
 //
-// See scanEEPROMForLatest for the initiation of this algorithm
+// See beginStep for the initiation of this algorithm, and
+// EEPROMLayout.h for decoding the array
+//
+// The EEPROM starts with the header, holding the layout version and the
+// multiplier, kept in two slots with the offset of the first entry
+// written with it. A new multiplier goes in the slot not in use, which is
+// then switched to, so a power loss never leaves half of one. The
+// entry is written before the multiplier, see latestMultiplier for how
+// begin() reads one a power loss kept from being written. The settings
+// follow it in a log of k_settings_log_bytes.
+// Changing a setting appends a record with its key, length and new value
+// at the head of the log, so only those few bytes are written, and the
+// cells of a setting aren't rewritten each time it changes. The key is
+// written last, so a record cut short by a power loss isn't read back.
+// The log is in two halves. When the one in use is full, the latest
+// record of each key is copied to the other, which is switched to by
+// writing its sequence number, so a power loss while compacting loses
+// nothing. begin() scans the log once, and keeps the offset of
+// each setting's latest value, the getters read it from there. The value
+// array follows the log.
 
 const int METRIC_FLAG = 0x1;
 
+// layout version of the EEPROM. A version 0 EEPROM is moved to this
+// layout, one with any other version is reinitialized. The high nibble
+// is the extra bytes of the value array entries. Version
+// 2 of the 2 byte entries had a step of 0x8fff, which put values from
+// 0x8000 on the end marker. Before versions 4, 19 and 35 the settings
+// log was in one piece, before 5, 20 and 36 its halves were 64 bytes,
+// before 6, 21 and 37 the header had one multiplier byte
+const byte k_eeprom_version = (EEPROMSTORE_RING_ENTRY_BYTES == 2) ? 6 :
+    5 + ((EEPROMSTORE_RING_ENTRY_BYTES - 2) << 4);
+
+// most byte writes done by EEPROMStore::flush, the value array entry and
+// its old marker, and with 2 byte entries a multiplier slot and the slot
+// in use, twice when the multiplier last changed at the same entry
+const int k_flush_max_writes = (EEPROMSTORE_RING_ENTRY_BYTES == 2) ? 11 :
+    EEPROMSTORE_RING_ENTRY_BYTES + 1;
+
+// most bytes of the value array EEPROMStore::beginStep reads by default
+const int k_begin_step_bytes = 64;
+
 // define if you want to see debug messages on the serial port
 #define SERIAL_DEBUG_MSG
 
-struct TripMarker
+// define if you want counters of EEPROM traffic, see EEPROMStore::stats()
+//#define EEPROMSTORE_STATS
+
+// a multiplier as stored, with the offset of the first value array entry
+// written with it
+struct EEPROMMultiplier
 {
-    byte multiplier;
-    word marker;
+    byte multiplier[Packed<byte>::size];
+    byte from[Packed<word>::size];
 };
 
+// the header as stored, each field packed, see EEPROMLayout.h
 struct EEPROMHeader 
 {
+    byte version[Packed<byte>::size];
+    // which of the multipliers is in use
+    byte multiplier_slot[Packed<byte>::size];
+    EEPROMMultiplier multipliers[2];
+};
+
+// offset in the header of a multiplier slot, only its low bit is used
+inline int multiplierOffset(byte slot)
+{
+    return offsetof(EEPROMHeader, multipliers) + (slot & 1) * sizeof(EEPROMMultiplier);
+}
+
+// the header of version 0, which held the settings, as the compiler laid
+// it out. Its value array followed it, 2 byte entries with a step of
+// 0x8fff. begin() moves an EEPROM in this layout to the current one
+struct EEPROMHeaderV0
+{
+    struct TripMarker
+    {
+        byte multiplier;
+        word marker;
+    };
+
     byte version;
     byte flags;
     word rpm_range;
@@ -57,13 +128,48 @@ struct EEPROMHeader
     TripMarker trip2;
 };
 
+// step of the multiplier of version 0
+const unsigned long k_v0_step = 0x8fff;
+
+// offset of the settings log, and of the mileage value array after it
+const int k_settings_start = sizeof(struct EEPROMHeader);
+const int k_ring_start = k_settings_start + k_settings_log_bytes;
+
+#if defined(EEPROMSTORE_STATS)
+// counters of the EEPROM traffic caused by the store
+struct EEPROMStoreStats
+{
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long skipped_updates;
+    unsigned long header_flushes;
+    unsigned long settings_compactions;
+    unsigned long ring_wraps;
+    unsigned long multiplier_changes;
+    unsigned long boot_scan_bytes;
+    unsigned long eeprom_micros;
+};
+#endif
+
 class EEPROMStore
 {
+    // reads through the store, defined below
+    struct EEPROMSource;
+
 public:
     explicit EEPROMStore();
 
     // read the eeprom and initialize all state
     void begin();
+
+    // begin in steps, so the sketch can do other things, such as bring up
+    // the display, while the mileage is found. beginStart reads the header
+    // and the settings, which can be used once it returns. Then call
+    // beginStep until it returns true, each call reads at most max_bytes
+    // of the value array. The mileage and trips are only right after
+    // that. Writing the mileage finishes the steps first
+    void beginStart();
+    bool beginStep(int max_bytes = k_begin_step_bytes);
 	
     // initialize the eeprom to it's starting state with zero mileage
     void initializeEEPROM();
@@ -72,14 +178,43 @@ public:
     // if the value is the same as already stored
     void writeMileage();
 
+    // set when service() writes the mileage: after every `units` of
+    // mileage, or once `ms` milliseconds have passed since service()
+    // last found nothing to write, whichever comes first. 0 turns off
+    // either, the default is both off
+    void setWritePolicy(unsigned long units, unsigned long ms);
+
+    // call from the loop, writes the mileage if the write policy says
+    // so. Returns true if the mileage was written. If it is called after
+    // every addition of at most one unit, a sudden power loss loses less
+    // than `units` of mileage, or `units` while service() is writing
+    bool service();
+
+    // write the mileage now, for a brown out or ignition off. Logs
+    // nothing. Takes at most k_flush_max_writes byte writes, 3.3 ms each,
+    // but if begin() hasn't finished its steps it first reads the rest
+    // of the value array, up to k_end_of_eeprom - k_ring_start bytes,
+    // and writes the multiplier if a power loss kept it from being.
+    // Must not interrupt another call into the store, so call it from
+    // the loop when the power fail interrupt has set a flag, or from the
+    // interrupt itself only if the loop is not in the store
+    void flush();
+
     // get the current mileage
     unsigned long mileage();
 
-    // add to the current mileage
+    // add to the current mileage, safe to call from an interrupt
+    // handler, but only from one context (single producer)
     void addMileage(unsigned long val);
 
     // set mileage
     void setMileage(unsigned long val);
+
+    // walk the mileage values in the value array, starting at the latest
+    // written, see RingHistory. Reads the EEPROM as it goes, so don't
+    // write the mileage while walking. Finishes the steps of begin first
+    typedef RingHistory<EEPROMSource> History;
+    History history();
     
     // get rpm range
     word rpmRange();
@@ -113,53 +248,187 @@ public:
     void setMetric();
     void setImperial();
 
-    // resett trip markers - set marker to current mileage settings
+    // reset a trip counter to 0, writes the mileage if any was added
+    // since it was written, then appends only that counter's marker. A
+    // counter past EEPROMSTORE_TRIPS is ignored
+    void resetTrip(byte n);
+
+    // get the distance on a trip counter, 0 past EEPROMSTORE_TRIPS
+    unsigned long trip(byte n);
+
+    // the first two trip counters
     void resetTrip1();
     void resetTrip2();
-
-    // get current trip value
     unsigned long trip1();
     unsigned long trip2();
+
+#if defined(EEPROMSTORE_STATS)
+    // counters since construction or the last resetStats
+    const EEPROMStoreStats& stats();
+    void resetStats();
+
+    // print the counters on one line of the serial port
+    void printStats();
+#endif
+
+#if defined(EEPROMSTORE_TRACE)
+    // hand a record of each call that can write the EEPROM to hook, 0
+    // turns it off. See EEPROMTrace.h
+    void setTraceHook(EEPROMTraceHook hook);
+#endif
     
 private:
 
-    // read the header field from the EEPROM
-    // this contains rarely written values
+    // all EEPROM access goes through these, so it can be counted. Without
+    // the counters they are the EEPROM calls themselves, defined below
+    byte eepromRead(int idx);
+    void eepromWrite(int idx, byte b);
+    void eepromUpdate(int idx, byte b);
+
+    // Source for the EEPROMLayout functions, reading through the store
+    struct EEPROMSource
+    {
+        explicit EEPROMSource(EEPROMStore& s) : store(&s) {}
+        byte operator[](int idx) const { return store->eepromRead(idx); }
+        EEPROMStore* store;
+    };
+
+    // read the header field from the EEPROM, and scan the settings log
     void readEEPROMHeader();
 
-    // find the current mileage stored in EEPROM
-    void readMileage();
+    // move the settings and mileage of a version 0 EEPROM to this layout,
+    // returns false if it is blank
+    bool migrateVersion0();
+
+    // get the latest value of a setting, returns false, and leaves value
+    // alone, if the log has none
+    template<typename T> bool readSetting(byte key, T& value);
+
+    // append a record for a setting to the log, if the value changed
+    template<typename T> void writeSetting(byte key, T value);
+
+    // append a record of the packed value bytes, if they changed
+    void appendSetting(byte key, const byte* value);
+
+    // copy the latest record of each setting to the other half of the
+    // log, with the new value of key
+    void compactSettings(byte key, const byte* value);
+
+    // write a record at an offset in the log, returns the offset past it
+    byte writeSettingRecord(byte off, byte key, const byte* value);
 
     // write a new mileage value, updates the multiplier if need be
-    void writeLatestEEPROM(word val);
+    void writeLatestEEPROM(RingValue val);
 
-    // read the EEPROM value array to get the latest mileage value
-    void scanEEPROMForLatest();
+    // run beginStep to the end, if the steps haven't finished
+    void finishBegin();
 
     // set the header structure to default values
     void resetHeader();
 
-    // update values in the header to EEPROM
+    // initializeEEPROM and writeMileage, without a trace record
+    void formatEEPROM();
+    void storeMileage();
+
+    // write the layout version in the header
     void updateHeader();
 
-    // manipulate mileage and multiplier pairs
-    unsigned long multiplyMileage(byte multiplier, word val);
-    bool collapseMileage(unsigned long mileage, byte& multiplier, word& val);
+    // write the multiplier, with the offset of the first entry written
+    // with it, to the slot not in use, then switch to that slot
+    void writeMultiplier(int from);
+
+    // offset of the first entry written with the multiplier in use
+    int multiplierFrom();
+
+    // set and get a trip marker in the settings log
+    void setTripMarker(byte n, unsigned long mileage);
+    unsigned long readTripMarker(byte n);
 
-    // the header
-    struct EEPROMHeader _header __attribute__ ((aligned (4)));
+    // the running total of addMileage
+    unsigned long addedMileage();
+
+    // record a call for the trace hook, after any mileage added since
+    // the last record
+#if defined(EEPROMSTORE_TRACE)
+    void trace(byte op, unsigned long a = 0, unsigned long b = 0);
+#else
+    void trace(byte, unsigned long = 0, unsigned long = 0) {}
+#endif
+
+    // the bits of the mileage above the value array entries, see
+    // ringMultiplier. The only field of the header that changes, with
+    // the offset it is from
+    byte _multiplier;
+
+    // offset in the settings log of the latest value of each key, 0 if
+    // there is none
+    byte _setting_index[KEY_COUNT];
+
+    // offset in the settings log of the next record, the half in use is
+    // the one it is in
+    byte _settings_head;
+
+    // trip markers, as in the settings log, so trip() doesn't read them
+    unsigned long _trip_base[EEPROMSTORE_TRIPS];
 	
-    // offset in eeprom to latest mileage value
+    // offset in eeprom to write the next mileage value, or of the scan
+    // while beginStep hasn't finished
     int _latest_offset;
 
-    // latest mileage value in eeprom (not real mileage, due to multiplier)
-    word _latest_val;
+    // true from beginStart until beginStep has found the mileage
+    bool _scanning;
 
-    // current mileage
+    // mileage last written to eeprom, the current mileage is this and
+    // what addMileage added since
     unsigned long _mileage;
 
-    // last mileage written to eeprom
-    unsigned long _written_mileage;
+    // write policy, see setWritePolicy
+    unsigned long _policy_units;
+    unsigned long _policy_ms;
+
+    // time the policy timer was last restarted
+    unsigned long _policy_start_ms;
+
+    // running total of mileage given to addMileage, only written by the
+    // producer, wraps around freely
+    volatile unsigned long _added;
+
+    // bumped by the producer after every update of _added
+    volatile byte _added_seq;
+
+    // value of _added included in _mileage
+    unsigned long _folded;
+
+#if defined(EEPROMSTORE_STATS)
+    EEPROMStoreStats _stats;
+#endif
+
+#if defined(EEPROMSTORE_TRACE)
+    EEPROMTraceHook _trace_hook;
+
+    // time of the last record
+    unsigned long _trace_ms;
+
+    // value of _added in the last record
+    unsigned long _trace_added;
+#endif
 };
 
+#if !defined(EEPROMSTORE_STATS)
+inline byte EEPROMStore::eepromRead(int idx)
+{
+    return EEPROM.read(idx);
+}
+
+inline void EEPROMStore::eepromWrite(int idx, byte b)
+{
+    EEPROM.write(idx, b);
+}
+
+inline void EEPROMStore::eepromUpdate(int idx, byte b)
+{
+    EEPROM.update(idx, b);
+}
+#endif
+
 #endif /* EEPROMSTORE_H_ */
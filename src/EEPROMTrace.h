@@ -0,0 +1,118 @@
+//============================================================================
+// Name        : EEPROMTrace.h
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : Trace records of the calls into the EEPROM Store
+//============================================================================
+
+#ifndef EEPROMTRACE_H_
+#define EEPROMTRACE_H_
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+// If EEPROMSTORE_TRACE is defined, the store hands a record of each call
+// that can change the EEPROM to the hook given to setTraceHook, which
+// the sketch sends or saves where it likes. tools/eeprom_replay plays a
+// trace back against other layouts and write policies.
+//
+// A record is the op byte, the milliseconds since the previous record,
+// then the arguments of the op, each as a varint: 7 bits a byte, least
+// significant first, the high bit set on all but the last byte. Mileage
+// given to addMileage isn't recorded in the interrupt handler, the
+// total added since the last record goes in a TRACE_ADD_MILEAGE record
+// ahead of the next one.
+
+// define to record calls into the store
+//#define EEPROMSTORE_TRACE
+
+enum EEPROMTraceOp
+{
+    // begin or beginStart, a power cycle
+    TRACE_BEGIN,
+    TRACE_INITIALIZE,
+    // mileage added
+    TRACE_ADD_MILEAGE,
+    TRACE_WRITE_MILEAGE,
+    TRACE_SERVICE,
+    TRACE_FLUSH,
+    // mileage
+    TRACE_SET_MILEAGE,
+    // units, ms
+    TRACE_SET_WRITE_POLICY,
+    // key, value bytes as a little endian number
+    TRACE_SETTING,
+    // trip
+    TRACE_RESET_TRIP,
+    TRACE_OP_COUNT
+};
+
+// most bytes in a record, the op and 3 varints
+const byte k_trace_record_bytes = 1 + 3 * 5;
+
+// called with each record
+typedef void (*EEPROMTraceHook)(const byte* record, byte len);
+
+// number of arguments of an op
+inline byte traceArgs(byte op)
+{
+    switch (op)
+    {
+    case TRACE_ADD_MILEAGE:
+    case TRACE_SET_MILEAGE:
+    case TRACE_RESET_TRIP:
+        return 1;
+    case TRACE_SET_WRITE_POLICY:
+    case TRACE_SETTING:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+// put a varint at p, returns its length
+inline byte traceVarint(byte* p, unsigned long v)
+{
+    byte n = 0;
+    while (v >= 0x80)
+    {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+// build a record in rec, returns its length
+inline byte traceRecord(byte* rec, byte op, unsigned long ms,
+                        unsigned long a, unsigned long b)
+{
+    byte n = 0;
+    rec[n++] = op;
+    n += traceVarint(rec + n, ms);
+    if (traceArgs(op) > 0)
+        n += traceVarint(rec + n, a);
+    if (traceArgs(op) > 1)
+        n += traceVarint(rec + n, b);
+    return n;
+}
+
+// decode a varint of at most len bytes at p, returns its length, or 0 if
+// it is cut short
+inline byte traceReadVarint(const byte* p, unsigned long len, unsigned long& v)
+{
+    v = 0;
+    for (byte n=0; n<5 && n<len; ++n)
+    {
+        v |= static_cast<unsigned long>(p[n] & 0x7f) << (7 * n);
+        if ((p[n] & 0x80) == 0)
+            return n + 1;
+    }
+    return 0;
+}
+
+#endif /* EEPROMTRACE_H_ */
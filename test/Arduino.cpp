@@ -0,0 +1,18 @@
+#include "Arduino.h"
+
+static unsigned long mock_micros = 0;
+
+unsigned long millis()
+{
+    return mock_micros / 1000;
+}
+
+unsigned long micros()
+{
+    return mock_micros;
+}
+
+void mockAdvanceMicros(unsigned long us)
+{
+    mock_micros += us;
+}
@@ -6,6 +6,21 @@
 typedef uint8_t byte;
 typedef uint16_t word;
 
+// the host has no separate program memory
+#define PROGMEM
+#define pgm_read_byte(p) (*reinterpret_cast<const uint8_t*>(p))
+#define pgm_read_ptr(p) (*reinterpret_cast<const void* const*>(p))
+
+// strings in flash, printed by the serial port
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(s))
+
+// mock clock, only moves when advanced by the test or the mock EEPROM
+unsigned long millis();
+unsigned long micros();
+void mockAdvanceMicros(unsigned long us);
+
+#include "Stream.h"
 #include "Serial.hpp"
 
 extern MockSerial Serial;
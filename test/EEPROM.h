@@ -2,16 +2,20 @@
 #define EEPROM_H_
 
 #include <Arduino.h>
+#include <memory>
 #include <vector>
 #include <stdexcept>
 
+// time taken by an AVR EEPROM byte write
+const unsigned long k_eeprom_write_micros = 3300;
+
 class MockEEPROM
 {
 public:
     MockEEPROM(size_t sz)
         : len(sz)
         {
-            mem.assign(len, 0);
+            reset();
         }
     
     int length()
@@ -20,13 +24,40 @@ public:
         }
 
     /*
-     * reset the eeprom memory to all zero's
+     * reset the eeprom memory to all zero's, and the wear counts
      */
     void reset()
         {
             mem.assign(len, 0);
+            writes.assign(len, 0);
+            reads = 0;
+            power_writes = -1;
         }
     
+    /*
+     * an image of the memory. It is never changed, so one image can be
+     * shared by any number of snapshots, and restored from any thread
+     */
+    typedef std::shared_ptr<const std::vector<byte> > Snapshot;
+
+    Snapshot snapshot() const
+        {
+            return std::make_shared<const std::vector<byte> >(mem);
+        }
+
+    /*
+     * put the memory back as it was at the snapshot, the wear counts
+     * start again from zero. The store must run begin() after this
+     */
+    void restore(const Snapshot& image)
+        {
+            if (!image || image->size() != len)
+                throw std::runtime_error("eeprom snapshot size");
+            mem = *image;
+            writes.assign(len, 0);
+            reads = 0;
+        }
+
     template< typename T > T& get(int idx, T& val)
         {
             int l = static_cast<int>(len - sizeof(T));
@@ -57,20 +88,29 @@ public:
     byte read(int idx)
         {
             byte b;
+            ++reads;
             return get(idx, b);
         }
 
     void write(int idx, byte b)
         {
+            // the power is gone, nothing is written
+            if (power_writes == 0)
+                return;
+            if (power_writes > 0)
+                --power_writes;
             put(idx, b);
+            ++writes[idx];
+            mockAdvanceMicros(k_eeprom_write_micros);
         }
 
     void update(int idx, byte b)
         {
-            put(idx, b);
+            if (read(idx) != b)
+                write(idx, b);
         }
 
-    bool compare(std::vector<byte>& shouldbe)
+    bool compare(const std::vector<byte>& shouldbe)
         {
             for (size_t i=0; i<len; ++i)
                 if (shouldbe[i] != mem[i])
@@ -80,6 +120,15 @@ public:
     
     size_t len;
     std::vector<byte> mem;
+
+    // number of byte writes to each cell
+    std::vector<unsigned long> writes;
+
+    // number of byte reads
+    unsigned long reads;
+
+    // byte writes left before the power is cut, -1 if it never is
+    long power_writes;
 };
 
 extern MockEEPROM EEPROM;
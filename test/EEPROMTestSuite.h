@@ -2,15 +2,88 @@
 #include <cxxtest/GlobalFixture.h>
 
 #include "EEPROMStore.h"
+#include "EEPROMLayout.h"
+#include "EEPROMLog.h"
+#include "EEPROMTrace.h"
+#include "EEPROMBackup.h"
+
+#include <vector>
+#include <deque>
+#include <cstring>
+#include <algorithm>
+
+// end of the value array, in EEPROMStore.cpp
+extern int k_end_of_eeprom;
+
+// records given to the trace hook
+static std::vector<byte> trace_records;
+
+static void traceHook(const byte* record, byte len)
+{
+    trace_records.insert(trace_records.end(), record, record + len);
+}
+
+// a serial port, bytes to the sketch in rx, from the sketch in tx
+class MockStream : public Stream
+{
+public:
+    int available()
+        {
+            return rx.size();
+        }
+
+    int read()
+        {
+            if (rx.empty())
+                return -1;
+            byte b = rx.front();
+            rx.pop_front();
+            return b;
+        }
+
+    size_t write(uint8_t b)
+        {
+            tx.push_back(b);
+            return 1;
+        }
+
+    // queue a frame for the sketch
+    void frame(byte cmd, const byte* payload, byte len)
+        {
+            word crc = backupCrc(0xffff, cmd);
+            crc = backupCrc(crc, len);
+            rx.push_back(k_backup_sync);
+            rx.push_back(cmd);
+            rx.push_back(len);
+            for (byte i=0; i<len; ++i)
+            {
+                rx.push_back(payload[i]);
+                crc = backupCrc(crc, payload[i]);
+            }
+            rx.push_back(crc & 0xff);
+            rx.push_back(crc >> 8);
+        }
+
+    std::deque<byte> rx;
+    std::vector<byte> tx;
+};
 
 class Fixture : public CxxTest::GlobalFixture
 {
     EEPROMStore* _store;
+
+    // an initialized EEPROM, each test starts from it
+    MockEEPROM::Snapshot _initialized;
     
 public:
     bool setUpWorld() 
         {
             Serial.begin();
+            EEPROM.reset();
+            EEPROMStore store;
+            store.begin();
+            store.initializeEEPROM();
+            _initialized = EEPROM.snapshot();
             return true;
         }
 
@@ -22,11 +95,18 @@ public:
     
     bool setUp() 
         {
-            EEPROM.reset();
+            _store = 0;
+            restore(_initialized);
+            return true;
+        }
+
+    // start the store again from a snapshot
+    void restore(const MockEEPROM::Snapshot& image)
+        {
+            delete _store;
+            EEPROM.restore(image);
             _store = new EEPROMStore();
             _store->begin();
-            _store->initializeEEPROM();
-            return true;
         }
 
     bool tearDown()
@@ -97,6 +177,27 @@ public:
             }
         }
 
+    void test_mileage_add_pending( void )
+        {
+            // additions are only folded in when the mileage is used
+            for (int i=0; i<1000; ++i)
+                fixture.store()->addMileage(3);
+            fixture.store()->writeMileage();
+            TS_ASSERT_EQUALS( fixture.store()->mileage(), 3000 );
+
+            EEPROMStore* store1 = new EEPROMStore();
+            store1->begin();
+            TS_ASSERT_EQUALS( store1->mileage(), 3000 );
+
+            // setting the mileage drops anything added before it
+            fixture.store()->addMileage(7);
+            fixture.store()->setMileage(100);
+            TS_ASSERT_EQUALS( fixture.store()->mileage(), 100 );
+            fixture.store()->addMileage(7);
+            TS_ASSERT_EQUALS( fixture.store()->mileage(), 107 );
+            TS_ASSERT_EQUALS( fixture.store()->trip1(), 7 );
+        }
+
     void test_mileage_set_add( void )
         {
             unsigned long m = 65000;
@@ -116,7 +217,7 @@ public:
 
     void test_mileage_rollover( void )
         {
-            unsigned long m = 255 * 0x8fff + 0x8ffe;
+            unsigned long m = k_mileage_rollover - 2;
             fixture.store()->setMileage(m);
             for (int i=0; i<3; ++i)
             {
@@ -131,6 +232,291 @@ public:
             TS_ASSERT_EQUALS( store1->trip2(), 3 );
         }
 
+    void test_mileage_reboot( void )
+        {
+            // each power cycle continues after the latest entry
+            for (unsigned long m=1; m<=2000; ++m)
+            {
+                EEPROMStore* store1 = new EEPROMStore();
+                store1->begin();
+                TS_ASSERT_EQUALS( store1->mileage(), m - 1 );
+                store1->addMileage(1);
+                store1->writeMileage();
+                delete store1;
+            }
+            EEPROMStore* store1 = new EEPROMStore();
+            store1->begin();
+            TS_ASSERT_EQUALS( store1->mileage(), 2000 );
+            delete store1;
+        }
+
+    void test_begin_steps( void )
+        {
+            fixture.store()->setContrast(20);
+            fixture.store()->setMileage(100);
+            for (int i=0; i<200; ++i)
+            {
+                fixture.store()->addMileage(1);
+                fixture.store()->writeMileage();
+            }
+
+            // the settings are there before the scan starts
+            EEPROMStore* store1 = new EEPROMStore();
+            store1->beginStart();
+            TS_ASSERT_EQUALS( store1->contrast(), 20 );
+            TS_ASSERT_EQUALS( store1->stats().boot_scan_bytes, 0 );
+            int steps = 1;
+            unsigned long scanned = 0;
+            while (!store1->beginStep(16))
+            {
+                TS_ASSERT_LESS_THAN_EQUALS( store1->stats().boot_scan_bytes - scanned, 16 );
+                scanned = store1->stats().boot_scan_bytes;
+                ++steps;
+            }
+            // whole entries, the latest is the 201st
+            const int per_step = 16 / k_ring_entry_bytes;
+            TS_ASSERT_EQUALS( steps, (201 + per_step - 1) / per_step );
+            TS_ASSERT_EQUALS( store1->mileage(), 300 );
+            TS_ASSERT( store1->beginStep() );
+            delete store1;
+
+            // writing the mileage finishes the scan first
+            store1 = new EEPROMStore();
+            store1->beginStart();
+            store1->beginStep(4);
+            store1->addMileage(1);
+            store1->writeMileage();
+            TS_ASSERT_EQUALS( store1->mileage(), 301 );
+            delete store1;
+            store1 = new EEPROMStore();
+            store1->begin();
+            TS_ASSERT_EQUALS( store1->mileage(), 301 );
+            delete store1;
+
+            // so does resetting a trip
+            store1 = new EEPROMStore();
+            store1->beginStart();
+            store1->beginStep(4);
+            store1->resetTrip(0);
+            TS_ASSERT_EQUALS( store1->mileage(), 301 );
+            TS_ASSERT_EQUALS( store1->trip(0), 0 );
+            delete store1;
+            store1 = new EEPROMStore();
+            store1->begin();
+            TS_ASSERT_EQUALS( store1->trip(0), 0 );
+            delete store1;
+        }
+
+    void test_ring_layout( void )
+        {
+            const int w = k_ring_entry_bytes;
+            byte image[32] = { 0 };
+            int offset;
+            RingValue val;
+            TS_ASSERT( !scanRing(image, 4, 32, offset, val) );
+            TS_ASSERT_EQUALS( val, 0 );
+            image[4 + w] = 0x81;
+            image[4 + 2 * w - 1] = 0x02;
+            TS_ASSERT( scanRing(image, 4, 32, offset, val) );
+            TS_ASSERT_EQUALS( offset, 4 + w );
+            TS_ASSERT_EQUALS( val, (1UL << 8 * (w - 1)) + 2 );
+
+            // walking forward and back visits the same entries, the last
+            // is the first at or past end less two entries
+            for (int start=4; start<4+w; ++start)
+            {
+                int entries = 0;
+                int off = start;
+                do
+                {
+                    TS_ASSERT_EQUALS( ringPrev(ringNext(off, start, 32), start, 32), off );
+                    off = ringNext(off, start, 32);
+                    ++entries;
+                } while (off != start);
+                TS_ASSERT_EQUALS( entries, (32 - w - 1 - start) / w + 1 );
+                TS_ASSERT_LESS_THAN_EQUALS( 32 - 2 * w, ringPrev(start, start, 32) );
+            }
+
+#if EEPROMSTORE_RING_ENTRY_BYTES == 2
+            // entries at 4, 6, 8, 10 and 12
+            TS_ASSERT_EQUALS( ringNext(10, 4, 16), 12 );
+            TS_ASSERT_EQUALS( ringNext(12, 4, 16), 4 );
+            TS_ASSERT_EQUALS( ringPrev(4, 4, 16), 12 );
+            TS_ASSERT_EQUALS( ringPrev(6, 4, 16), 4 );
+            // odd start, entries at 5, 7, 9, 11 and 13
+            TS_ASSERT_EQUALS( ringNext(13, 5, 16), 5 );
+            TS_ASSERT_EQUALS( ringPrev(5, 5, 16), 13 );
+#endif
+        }
+
+    void test_write_policy_units( void )
+        {
+            const unsigned long units = 10;
+            fixture.store()->setWritePolicy(units, 0);
+            int writes = 0;
+            for (int i=0; i<1000; ++i)
+            {
+                fixture.store()->addMileage(1);
+                if (fixture.store()->service())
+                    ++writes;
+
+                // power lost here loses less than the policy allows
+                if (i % 37 == 0)
+                {
+                    EEPROMStore* store1 = new EEPROMStore();
+                    store1->begin();
+                    unsigned long m = fixture.store()->mileage();
+                    TS_ASSERT_LESS_THAN_EQUALS( store1->mileage(), m );
+                    TS_ASSERT_LESS_THAN( m - store1->mileage(), units );
+                    delete store1;
+                }
+            }
+            TS_ASSERT_EQUALS( writes, 1000 / units );
+        }
+
+    void test_write_policy_power_loss( void )
+        {
+            // a unit at a time is added across a multiplier change, and
+            // service() or flush() called. The power is cut after each
+            // addition, and at each write they make. After a begin the
+            // mileage is never ahead, and at most the policy's units
+            // behind, less when the cut isn't in a write
+            const unsigned long units = 10;
+            const unsigned long start = 0x8000 - 3 * units / 2;
+            EEPROMStore* store = fixture.store();
+            store->setMileage(start);
+            store->setWritePolicy(units, 0);
+            for (unsigned long m=start + 1; m<=start + 3 * units; ++m)
+            {
+                store->addMileage(1);
+                MockEEPROM::Snapshot image = EEPROM.snapshot();
+                for (int flush=0; flush<2; ++flush)
+                {
+                    // a store in the same state, the writes it makes
+                    long writes = -1;
+                    for (long cut=-1; cut<=writes; ++cut)
+                    {
+                        EEPROM.restore(image);
+                        EEPROMStore store1;
+                        store1.begin();
+                        store1.setWritePolicy(units, 0);
+                        store1.addMileage(m - store1.mileage());
+                        store1.resetStats();
+                        EEPROM.power_writes = cut;
+                        if (flush)
+                            store1.flush();
+                        else
+                            store1.service();
+                        EEPROM.power_writes = -1;
+                        if (cut < 0)
+                            writes = store1.stats().writes;
+
+                        EEPROMStore store2;
+                        store2.begin();
+                        TS_ASSERT_LESS_THAN_EQUALS( store2.mileage(), m );
+                        if (cut < 0)
+                            TS_ASSERT_LESS_THAN( m - store2.mileage(), units );
+                        TS_ASSERT_LESS_THAN_EQUALS( m - store2.mileage(), units );
+                        if (cut < 0 && flush)
+                            TS_ASSERT_EQUALS( store2.mileage(), m );
+                    }
+                }
+                EEPROM.restore(image);
+                store->service();
+            }
+            TS_ASSERT_EQUALS( store->mileage(), start + 3 * units );
+            EEPROMStore store1;
+            store1.begin();
+            TS_ASSERT_EQUALS( store1.mileage(), start + 3 * units );
+        }
+
+    void test_write_policy_time( void )
+        {
+            fixture.store()->setWritePolicy(0, 1000);
+            TS_ASSERT( !fixture.store()->service() );
+            // the timer runs from the last call with nothing to write
+            mockAdvanceMicros(5000000);
+            TS_ASSERT( !fixture.store()->service() );
+            fixture.store()->addMileage(1);
+            TS_ASSERT( !fixture.store()->service() );
+            mockAdvanceMicros(999000);
+            fixture.store()->addMileage(1);
+            TS_ASSERT( !fixture.store()->service() );
+            mockAdvanceMicros(1000);
+            TS_ASSERT( fixture.store()->service() );
+            TS_ASSERT( !fixture.store()->service() );
+
+            EEPROMStore* store1 = new EEPROMStore();
+            store1->begin();
+            TS_ASSERT_EQUALS( store1->mileage(), 2 );
+            delete store1;
+        }
+
+    void test_flush( void )
+        {
+            // worst case is a multiplier change, the worst of those one at
+            // the entry the multiplier in use is from, a lap of the array
+            // after it was set
+            int entries = (k_end_of_eeprom - k_ring_entry_bytes - k_ring_start
+                           + k_ring_entry_bytes - 1) / k_ring_entry_bytes;
+            for (int lap=0; lap<2; ++lap)
+            {
+                fixture.restore(EEPROM.snapshot());
+                EEPROMStore* store = fixture.store();
+                store->initializeEEPROM();
+                store->setMileage(lap ? 0x8000 - entries : 0x7ffe);
+                while (store->mileage() < 0x7fff)
+                {
+                    store->addMileage(1);
+                    store->writeMileage();
+                }
+                MockEEPROM::Snapshot before = EEPROM.snapshot();
+                store->resetStats();
+                store->addMileage(2);
+#if defined(EEPROMSTORE_BINARY_LOG)
+                byte logged = StoreLog.available();
+#endif
+                store->flush();
+#if EEPROMSTORE_RING_ENTRY_BYTES == 2
+                TS_ASSERT_EQUALS( store->stats().multiplier_changes, 1 );
+#endif
+#if defined(EEPROMSTORE_BINARY_LOG)
+                // nothing is logged
+                TS_ASSERT_EQUALS( StoreLog.available(), logged );
+#endif
+                unsigned long writes = store->stats().writes;
+                TS_ASSERT_LESS_THAN_EQUALS( writes, k_flush_max_writes );
+
+                EEPROMStore* store1 = new EEPROMStore();
+                store1->begin();
+                TS_ASSERT_EQUALS( store1->mileage(), 0x8001 );
+                delete store1;
+
+                // the power is cut at each write of the flush in turn, the
+                // mileage read back is the old or the new one, and the
+                // next write carries on from it
+                for (unsigned long cut=0; cut<writes; ++cut)
+                {
+                    fixture.restore(before);
+                    fixture.store()->addMileage(2);
+                    EEPROM.power_writes = cut;
+                    fixture.store()->flush();
+                    EEPROM.power_writes = -1;
+                    store1 = new EEPROMStore();
+                    store1->begin();
+                    unsigned long m = store1->mileage();
+                    TS_ASSERT( m == 0x7fff || m == 0x8001 );
+                    store1->addMileage(0x8002 - m);
+                    store1->writeMileage();
+                    delete store1;
+                    store1 = new EEPROMStore();
+                    store1->begin();
+                    TS_ASSERT_EQUALS( store1->mileage(), 0x8002 );
+                    delete store1;
+                }
+            }
+        }
+
     void test_mileage_write( void )
         {
             fixture.store()->addMileage(4);
@@ -249,6 +635,752 @@ public:
 
             TS_ASSERT_EQUALS( fixture.store()->trip1(), 5*5 + 5*5 );
             TS_ASSERT_EQUALS( fixture.store()->trip2(), 5*5 );
+
+            // the mileage added is written with the marker, so after a
+            // power loss the trip isn't below 0, and wrapped round
+            fixture.store()->resetTrip1();
+            EEPROMStore* store1 = new EEPROMStore();
+            store1->begin();
+            TS_ASSERT_EQUALS( store1->mileage(), m + 3*5*5 );
+            TS_ASSERT_EQUALS( store1->trip1(), 0 );
+            TS_ASSERT_EQUALS( store1->trip2(), 5*5 );
+            delete store1;
+        }
+
+    void test_trips( void )
+        {
+            EEPROMStore* store = fixture.store();
+            store->setMileage(k_mileage_rollover - 10);
+            for (byte n=0; n<EEPROMSTORE_TRIPS; ++n)
+            {
+                store->addMileage(1);
+                store->resetTrip(n);
+            }
+            for (int i=0; i<20; ++i)
+            {
+                store->addMileage(1);
+                store->writeMileage();
+            }
+            for (byte n=0; n<EEPROMSTORE_TRIPS; ++n)
+                TS_ASSERT_EQUALS( store->trip(n), 20 + EEPROMSTORE_TRIPS - 1 - n );
+
+            // the markers are kept in RAM, a trip reads nothing
+            store->resetStats();
+            store->trip(1);
+            TS_ASSERT_EQUALS( store->stats().reads, 0 );
+
+            // resetting one trip only appends its marker, or when the log
+            // is full copies a record of each key and the sequence numbers
+            store->resetStats();
+            store->resetTrip(2);
+            TS_ASSERT_EQUALS( store->stats().header_flushes, 0 );
+            TS_ASSERT_LESS_THAN_EQUALS( store->stats().writes,
+                                        store->stats().settings_compactions ?
+                                        settingsRecordBytes() + 4 :
+                                        k_trip_marker_bytes + k_setting_overhead );
+            TS_ASSERT_EQUALS( store->trip(2), 0 );
+
+            // the mileage rolled over, trips carry on across it
+            EEPROMStore* store1 = new EEPROMStore();
+            store1->begin();
+            TS_ASSERT_LESS_THAN( store1->mileage(), 20 );
+            TS_ASSERT_EQUALS( store1->trip(0), 20 + EEPROMSTORE_TRIPS - 1 );
+            TS_ASSERT_EQUALS( store1->trip(2), 0 );
+            TS_ASSERT_EQUALS( store1->trip(EEPROMSTORE_TRIPS - 1), 20 );
+
+            // a counter past the last is ignored, the log is left alone
+            store1->resetStats();
+            store1->resetTrip(EEPROMSTORE_TRIPS);
+            TS_ASSERT_EQUALS( store1->stats().writes, 0 );
+            TS_ASSERT_EQUALS( store1->trip(EEPROMSTORE_TRIPS), 0 );
+            store1->setContrast(44);
+            delete store1;
+            store1 = new EEPROMStore();
+            store1->begin();
+            TS_ASSERT_EQUALS( store1->contrast(), 44 );
+            TS_ASSERT_EQUALS( store1->trip(EEPROMSTORE_TRIPS - 1), 20 );
+            delete store1;
+        }
+
+    void test_stats( void )
+        {
+            EEPROMStore* store = fixture.store();
+            store->resetStats();
+            store->writeMileage();
+            TS_ASSERT_EQUALS( store->stats().writes, 0 );
+
+            // first entry has no old marker to clear
+            store->addMileage(1);
+            store->writeMileage();
+            TS_ASSERT_EQUALS( store->stats().writes, 2 );
+            store->addMileage(1);
+            store->writeMileage();
+            TS_ASSERT_EQUALS( store->stats().writes, 5 );
+            TS_ASSERT_EQUALS( store->stats().eeprom_micros,
+                              5 * k_eeprom_write_micros );
+
+            // a setting appends its key, length and value, the
+            // terminator after it is already there
+            store->resetStats();
+            store->setContrast(10);
+            TS_ASSERT_EQUALS( store->stats().header_flushes, 0 );
+            TS_ASSERT_EQUALS( store->stats().writes, 3 );
+            TS_ASSERT_EQUALS( store->stats().skipped_updates, 1 );
+            store->resetStats();
+            store->setContrast(10);
+            TS_ASSERT_EQUALS( store->stats().writes, 0 );
+
+            store->setMileage(0x7ffe);
+            store->resetStats();
+            store->addMileage(2);
+            store->writeMileage();
+#if EEPROMSTORE_RING_ENTRY_BYTES == 2
+            TS_ASSERT_EQUALS( store->stats().multiplier_changes, 1 );
+            TS_ASSERT_EQUALS( store->stats().header_flushes, 1 );
+#else
+            // the header is left alone as the mileage grows
+            TS_ASSERT_EQUALS( store->stats().multiplier_changes, 0 );
+            TS_ASSERT_EQUALS( store->stats().header_flushes, 0 );
+#endif
+
+            EEPROMStore* store1 = new EEPROMStore();
+            store1->begin();
+            // four entries in the ring
+            TS_ASSERT_EQUALS( store1->stats().boot_scan_bytes, 4 * k_ring_entry_bytes );
+            TS_ASSERT_EQUALS( store1->stats().writes, 0 );
+            store1->printStats();
+            store1->resetStats();
+            TS_ASSERT_EQUALS( store1->stats().reads, 0 );
+        }
+
+    void test_migrate_version0( void )
+        {
+            // a version 0 EEPROM, the header as it laid it out and the
+            // value array after it
+            EEPROM.reset();
+            EEPROMHeaderV0 h;
+            memset(&h, 0, sizeof(h));
+            h.flags = METRIC_FLAG;
+            h.rpm_range = 9000;
+            h.contrast = 40;
+            h.multiplier = 2;
+            h.backlight_hi = 0x01;
+            h.backlight_lo = 0x20;
+            h.voltage_offset = 0.5;
+            h.voltage_correction = 1.25;
+            h.speedo_correction = 0.75;
+            h.trip1.multiplier = 1;
+            h.trip1.marker = 100;
+            h.trip2.multiplier = 2;
+            h.trip2.marker = 5;
+            EEPROM.put(0, h);
+            // entries past the start of this layout's value array, the
+            // last one with the end marker
+            const int entries = 200;
+            const word val = 0x10 + entries - 1;
+            for (int i=0; i<entries; ++i)
+            {
+                word v = 0x10 + i;
+                if (i == entries - 1)
+                    v |= 0x8000;
+                EEPROM.write(sizeof(h) + 2 * i, v >> 8);
+                EEPROM.write(sizeof(h) + 2 * i + 1, v & 0xff);
+            }
+            TS_ASSERT( sizeof(h) + 2 * entries > k_ring_start + 2 * k_ring_entry_bytes );
+            MockEEPROM::Snapshot v0 = EEPROM.snapshot();
+
+            // moved once, then read as this layout
+            const unsigned long mileage = 2 * k_v0_step + val;
+            unsigned long writes = 0;
+            for (int boot=0; boot<2; ++boot)
+            {
+                EEPROMStore* store1 = new EEPROMStore();
+                store1->begin();
+                if (boot == 0)
+                    writes = store1->stats().writes;
+                TS_ASSERT_EQUALS( EEPROM.read(0), k_eeprom_version );
+                TS_ASSERT_EQUALS( store1->mileage(), mileage );
+                TS_ASSERT( store1->isMetric() );
+                TS_ASSERT_EQUALS( store1->rpmRange(), 9000 );
+                TS_ASSERT_EQUALS( store1->contrast(), 40 );
+                TS_ASSERT_EQUALS( store1->backlight(), 0x120 );
+                TS_ASSERT_EQUALS( store1->voltageOffset(), 0.5 );
+                TS_ASSERT_EQUALS( store1->voltageCorrection(), 1.25 );
+                TS_ASSERT_EQUALS( store1->speedoCorrection(), 0.75 );
+                TS_ASSERT_EQUALS( store1->trip(0), mileage - (k_v0_step + 100) );
+                TS_ASSERT_EQUALS( store1->trip(1), val - 5 );
+                TS_ASSERT_EQUALS( store1->trip(2), 0 );
+                delete store1;
+            }
+            // the old entries are cleared
+            for (int i=k_ring_start + k_ring_entry_bytes; i<k_end_of_eeprom; ++i)
+                TS_ASSERT_EQUALS( EEPROM.read(i), 0 );
+
+            // a power loss before the version is written leaves it to be
+            // formatted, after it, while the old entries are cleared,
+            // leaves it moved
+            int cleared = 0;
+            for (int i=k_ring_start + k_ring_entry_bytes; i<k_end_of_eeprom; ++i)
+                if ((*v0)[i] != 0)
+                    ++cleared;
+            int formatted = 0;
+            for (unsigned long cut=1; cut<writes; ++cut)
+            {
+                EEPROM.restore(v0);
+                EEPROM.power_writes = cut;
+                EEPROMStore* store1 = new EEPROMStore();
+                store1->begin();
+                delete store1;
+                EEPROM.power_writes = -1;
+                store1 = new EEPROMStore();
+                store1->begin();
+                if (store1->mileage() == mileage)
+                {
+                    TS_ASSERT_EQUALS( store1->contrast(), 40 );
+                    TS_ASSERT_EQUALS( store1->trip(1), val - 5 );
+                }
+                else
+                {
+                    // once moved, a later power loss doesn't undo it
+                    TS_ASSERT_EQUALS( formatted, (int)cut - 1 );
+                    TS_ASSERT_EQUALS( store1->mileage(), 0 );
+                    TS_ASSERT_EQUALS( store1->contrast(), 50 );
+                    ++formatted;
+                }
+                delete store1;
+            }
+            TS_ASSERT_LESS_THAN( 0, formatted );
+            TS_ASSERT_LESS_THAN_EQUALS( cleared, (int)writes - 1 - formatted );
+        }
+
+    void test_packed_layout( void )
+        {
+            // no padding, the value array starts right after the log
+            TS_ASSERT_EQUALS( sizeof(EEPROMHeader), 8 );
+            TS_ASSERT_EQUALS( multiplierOffset(3), 5 );
+            TS_ASSERT_EQUALS( k_settings_start, 8 );
+            TS_ASSERT_EQUALS( k_ring_start, 8 + k_settings_log_bytes );
+            TS_ASSERT_EQUALS( settingSize(KEY_CONTRAST), 1 );
+            TS_ASSERT_EQUALS( settingSize(KEY_BACKLIGHT), 2 );
+            TS_ASSERT_EQUALS( settingSize(KEY_SPEEDO_CORRECTION), 4 );
+            TS_ASSERT_EQUALS( settingSize(KEY_TRIP), k_trip_marker_bytes );
+
+            // little endian, floats as IEEE single
+            byte p[4];
+            Packed<word>::put(p, 0x1234);
+            TS_ASSERT_EQUALS( p[0], 0x34 );
+            TS_ASSERT_EQUALS( p[1], 0x12 );
+            TS_ASSERT_EQUALS( Packed<word>::get(p, 0), 0x1234 );
+            Packed<float>::put(p, -2.0f);
+            TS_ASSERT_EQUALS( p[0], 0x00 );
+            TS_ASSERT_EQUALS( p[2], 0x00 );
+            TS_ASSERT_EQUALS( p[3], 0xc0 );
+            TS_ASSERT_EQUALS( Packed<float>::get(p, 0), -2.0f );
+            PackedTripMarker::put(p, 0x123456);
+            TS_ASSERT_EQUALS( p[0], 0x56 );
+            TS_ASSERT_EQUALS( p[2], 0x12 );
+            TS_ASSERT_EQUALS( tripMarker(p, 0), 0x123456 );
+
+            // a setting is stored as packed
+            fixture.store()->setVoltageCorrection(-2.0f);
+            fixture.store()->setBacklight(0x1234);
+            const int rec = k_settings_start + 1;
+            TS_ASSERT_EQUALS( EEPROM.read(rec - 1), 1 );
+            TS_ASSERT_EQUALS( EEPROM.read(rec), KEY_VOLTAGE_CORRECTION );
+            TS_ASSERT_EQUALS( EEPROM.read(rec + 1), 4 );
+            TS_ASSERT_EQUALS( EEPROM.read(rec + 5), 0xc0 );
+            TS_ASSERT_EQUALS( EEPROM.read(rec + 6), KEY_BACKLIGHT );
+            TS_ASSERT_EQUALS( EEPROM.read(rec + 8), 0x34 );
+            TS_ASSERT_EQUALS( EEPROM.read(rec + 9), 0x12 );
+        }
+
+    void test_settings_log( void )
+        {
+            EEPROMStore* store = fixture.store();
+            store->setContrast(10);
+            store->setVoltageOffset(2.5);
+            store->setMetric();
+
+            // enough changes to fill the log a few times over
+            store->resetStats();
+            for (int i=0; i<100; ++i)
+            {
+                store->setContrast(i);
+                store->setBacklight(1000 + i);
+            }
+            TS_ASSERT_LESS_THAN( 0, store->stats().settings_compactions );
+            TS_ASSERT_EQUALS( store->stats().header_flushes, 0 );
+            TS_ASSERT_EQUALS( store->contrast(), 99 );
+            TS_ASSERT_EQUALS( store->backlight(), 1099 );
+            TS_ASSERT_EQUALS( store->voltageOffset(), 2.5 );
+            TS_ASSERT( store->isMetric() );
+
+            EEPROMStore* store1 = new EEPROMStore();
+            store1->begin();
+            TS_ASSERT_EQUALS( store1->contrast(), 99 );
+            TS_ASSERT_EQUALS( store1->backlight(), 1099 );
+            TS_ASSERT_EQUALS( store1->voltageOffset(), 2.5 );
+            TS_ASSERT_EQUALS( store1->rpmRange(), 12000 );
+            TS_ASSERT( store1->isMetric() );
+            delete store1;
+
+            // the scan stops at a record with a bad length or key
+            byte image[k_settings_log_bytes] = { 1, KEY_CONTRAST, 1, 7,
+                                                 KEY_FLAGS, 1, 1,
+                                                 KEY_CONTRAST, 2, 8, 0 };
+            byte index[KEY_COUNT];
+            TS_ASSERT_EQUALS( scanSettings(image, 0, index), 7 );
+            TS_ASSERT_EQUALS( index[KEY_CONTRAST], 3 );
+            TS_ASSERT_EQUALS( index[KEY_FLAGS], 6 );
+            TS_ASSERT_EQUALS( index[KEY_RPM_RANGE], 0 );
+            image[7] = KEY_COUNT;
+            image[8] = 1;
+            TS_ASSERT_EQUALS( scanSettings(image, 0, index), 7 );
+
+            // the half with the next sequence number is in use, the
+            // numbers wrap past 0
+            byte* second = image + k_settings_half_bytes;
+            second[1] = KEY_CONTRAST;
+            second[2] = 1;
+            second[3] = 9;
+            second[0] = 2;
+            TS_ASSERT_EQUALS( scanSettings(image, 0, index),
+                              k_settings_half_bytes + 4 );
+            TS_ASSERT_EQUALS( index[KEY_FLAGS], 0 );
+            image[0] = 0xff;
+            second[0] = 1;
+            TS_ASSERT_EQUALS( scanSettings(image, 0, index),
+                              k_settings_half_bytes + 4 );
+            image[0] = 2;
+            TS_ASSERT_EQUALS( scanSettings(image, 0, index), 7 );
+        }
+
+    void test_settings_power_loss( void )
+        {
+            EEPROMStore* store = fixture.store();
+            store->setContrast(10);
+            store->setVoltageOffset(2.5);
+            store->setMetric();
+            store->resetTrip(1);
+            for (int i=0; i<100; ++i)
+                store->setBacklight(i);
+
+            // the power is cut at each write of a compaction in turn,
+            // after a begin every setting has the old or the new value
+            MockEEPROM::Snapshot before;
+            int backlight = 1000;
+            do
+            {
+                before = EEPROM.snapshot();
+                store->resetStats();
+                store->setBacklight(++backlight);
+            } while (store->stats().settings_compactions == 0);
+            unsigned long writes = store->stats().writes;
+            for (unsigned long cut=0; cut<=writes; ++cut)
+            {
+                fixture.restore(before);
+                EEPROMStore* store1 = new EEPROMStore();
+                store1->begin();
+                EEPROM.power_writes = cut;
+                store1->setBacklight(backlight);
+                EEPROM.power_writes = -1;
+                delete store1;
+                store1 = new EEPROMStore();
+                store1->begin();
+                TS_ASSERT_EQUALS( store1->contrast(), 10 );
+                TS_ASSERT_EQUALS( store1->voltageOffset(), 2.5 );
+                TS_ASSERT( store1->isMetric() );
+                TS_ASSERT_EQUALS( store1->trip(1), 0 );
+                if (cut < writes)
+                    TS_ASSERT_LESS_THAN_EQUALS( backlight - 1, store1->backlight() );
+                else
+                    TS_ASSERT_EQUALS( store1->backlight(), backlight );
+                TS_ASSERT_LESS_THAN_EQUALS( store1->backlight(), backlight );
+                delete store1;
+            }
+        }
+
+    void test_settings_wear( void )
+        {
+            // every key has a record, so they fill as much of a half as
+            // they can after a compaction
+            EEPROMStore* store = fixture.store();
+            store->setMetric();
+            store->setRPMRange(9000);
+            store->setContrast(10);
+            store->setBacklight(100);
+            store->setVoltageOffset(0.5);
+            store->setVoltageCorrection(1.5);
+            store->setSpeedoCorrection(0.5);
+            for (byte n=0; n<EEPROMSTORE_TRIPS; ++n)
+                store->resetTrip(n);
+
+            // the records take at most half a half, so a compaction comes
+            // after at least that many bytes of changes, and no cell of
+            // the log is written more than about once for each compaction
+            const int changes = 1000;
+            const int free = (k_settings_half_bytes - 1) / 2;
+            for (int trips=0; trips<2; ++trips)
+            {
+                EEPROM.writes.assign(EEPROM.len, 0);
+                store->resetStats();
+                byte key = trips ? KEY_TRIP : KEY_CONTRAST;
+                for (int i=0; i<changes; ++i)
+                {
+                    if (trips)
+                    {
+                        store->addMileage(1);
+                        store->resetTrip(0);
+                    }
+                    else
+                        store->setContrast(i & 1);
+                }
+                const int per = free / (k_setting_overhead + settingSize(key));
+                TS_ASSERT_LESS_THAN_EQUALS( store->stats().settings_compactions,
+                                            changes / per + 1 );
+                unsigned long hottest = 0;
+                for (int i=k_settings_start; i<k_ring_start; ++i)
+                    hottest = std::max(hottest, EEPROM.writes[i]);
+                TS_ASSERT_LESS_THAN_EQUALS( hottest, changes / per + 2 );
+            }
+            EEPROMStore* store1 = new EEPROMStore();
+            store1->begin();
+            TS_ASSERT_EQUALS( store1->contrast(), 1 );
+            TS_ASSERT_EQUALS( store1->trip(0), 0 );
+            TS_ASSERT_EQUALS( store1->trip(1), changes );
+            TS_ASSERT_EQUALS( store1->voltageCorrection(), 1.5 );
+            delete store1;
+        }
+
+    void test_trace( void )
+        {
+            trace_records.clear();
+            EEPROMStore* store1 = new EEPROMStore();
+            store1->setTraceHook(traceHook);
+            store1->begin();
+            store1->setWritePolicy(300, 2000);
+            store1->addMileage(200);
+            store1->addMileage(100);
+            mockAdvanceMicros(1500000);
+            store1->service();
+            store1->setContrast(7);
+            store1->resetTrip(1);
+            delete store1;
+
+            // the internal write of service isn't recorded
+            byte expect[] = { TRACE_BEGIN, 0,
+                              TRACE_SET_WRITE_POLICY, 0, 0xac, 0x02, 0xd0, 0x0f,
+                              TRACE_ADD_MILEAGE, 0xdc, 0x0b, 0xac, 0x02,
+                              TRACE_SERVICE, 0 };
+            TS_ASSERT_LESS_THAN( sizeof(expect), trace_records.size() );
+            for (size_t i=0; i<sizeof(expect) && i<trace_records.size(); ++i)
+                TS_ASSERT_EQUALS( trace_records[i], expect[i] );
+
+            // the rest as decoded, the times depend on the writes
+            byte ops[] = { TRACE_SETTING, TRACE_RESET_TRIP };
+            unsigned long args[][2] = { { KEY_CONTRAST, 7 }, { 1, 0 } };
+            size_t off = sizeof(expect);
+            for (int r=0; r<2; ++r)
+            {
+                TS_ASSERT_EQUALS( trace_records[off++], ops[r] );
+                unsigned long v[3] = { 0 };
+                for (byte a=0; a<=traceArgs(ops[r]); ++a)
+                    off += traceReadVarint(&trace_records[off],
+                                           trace_records.size() - off, v[a]);
+                TS_ASSERT_EQUALS( v[1], args[r][0] );
+                TS_ASSERT_EQUALS( v[2], args[r][1] );
+            }
+            TS_ASSERT_EQUALS( off, trace_records.size() );
+
+            unsigned long v;
+            TS_ASSERT_EQUALS( traceReadVarint(expect + 4, 2, v), 2 );
+            TS_ASSERT_EQUALS( v, 300 );
+            TS_ASSERT_EQUALS( traceReadVarint(expect + 4, 1, v), 0 );
+        }
+
+    void test_mileage_codec( void )
+        {
+            static_assert(ringMileage(ringMultiplier(k_mileage_rollover - 1),
+                                      ringValue(k_mileage_rollover - 1))
+                          == k_mileage_rollover - 1, "codec is constexpr");
+
+            // every mileage with 2 or 3 byte entries, the value never
+            // reaches the end marker, and decodes as it was written
+            unsigned long stride = (k_mileage_rollover > (1UL << 24)) ? 257 : 1;
+            unsigned long bad = 0;
+            byte entry[k_ring_entry_bytes];
+            for (unsigned long m=0; m<k_mileage_rollover; m+=stride)
+            {
+                RingValue val = ringValue(m);
+                for (byte i=k_ring_entry_bytes; i>0; --i)
+                {
+                    entry[i - 1] = val & 0xff;
+                    val >>= 8;
+                }
+                if (entry[0] & k_end_marker)
+                    ++bad;
+                entry[0] |= k_end_marker;
+                if (!ringEntry(entry, 0, val)
+                    || ringMileage(ringMultiplier(m), val) != m)
+                    ++bad;
+            }
+            TS_ASSERT_EQUALS( bad, 0 );
+
+            // values from 0x8000 to 0x8fff survive a power cycle
+            EEPROMStore* store = fixture.store();
+            store->setMileage(0x7ffd);
+            for (int i=0; i<6; ++i)
+            {
+                store->addMileage(0x400);
+                store->writeMileage();
+                EEPROMStore store1;
+                store1.begin();
+                TS_ASSERT_EQUALS( store1.mileage(), 0x7ffd + 0x400 * (i + 1) );
+            }
+
+            // the history walks back over the multiplier change
+            EEPROMStore::History h = store->history();
+            for (int i=5; h.prev(); --i)
+                TS_ASSERT_EQUALS( h.mileage(), 0x7ffd + 0x400 * i );
+            TS_ASSERT_EQUALS( h.mileage(), 0x7ffd );
+            while (h.next())
+                ;
+            TS_ASSERT_EQUALS( h.mileage(), store->mileage() );
+        }
+
+    void test_history( void )
+        {
+            EEPROMStore* store = fixture.store();
+            EEPROMStore::History blank = store->history();
+            TS_ASSERT( !blank.first() );
+            TS_ASSERT( !blank.prev() );
+
+            store->setMileage(1000);
+            for (int i=0; i<5; ++i)
+            {
+                store->addMileage(7);
+                store->writeMileage();
+            }
+            EEPROMStore::History h = store->history();
+            TS_ASSERT_EQUALS( h.mileage(), 1035 );
+            int n = 0;
+            while (h.prev())
+                TS_ASSERT_EQUALS( h.mileage(), 1035 - 7 * ++n );
+            TS_ASSERT_EQUALS( n, 5 );
+            TS_ASSERT( h.first() );
+            TS_ASSERT_EQUALS( h.mileage(), 1000 );
+            for (n=1; h.next(); ++n)
+                TS_ASSERT_EQUALS( h.mileage(), 1000 + 7 * n );
+            TS_ASSERT_EQUALS( n, 6 );
+
+            // after the array wraps, all of it is history, the values
+            // written over are gone
+            int entries = (k_end_of_eeprom - k_ring_entry_bytes - k_ring_start
+                           + k_ring_entry_bytes - 1) / k_ring_entry_bytes;
+            for (int i=0; i<entries; ++i)
+            {
+                store->addMileage(3);
+                store->writeMileage();
+            }
+            h = store->history();
+            TS_ASSERT_EQUALS( h.mileage(), store->mileage() );
+            int latest = h.offset();
+            TS_ASSERT( h.first() );
+            TS_ASSERT_EQUALS( h.back(), entries - 1 );
+            TS_ASSERT_EQUALS( h.mileage(), store->mileage() - 3 * (entries - 1) );
+            TS_ASSERT_EQUALS( h.offset(), ringNext(latest, k_ring_start, k_end_of_eeprom) );
+            while (h.next())
+                ;
+            TS_ASSERT_EQUALS( h.mileage(), store->mileage() );
+
+            // the walk back ends where the mileage was set back
+            store->setMileage(10);
+            h = store->history();
+            TS_ASSERT_EQUALS( h.mileage(), 10 );
+            TS_ASSERT( !h.prev() );
+
+            // a value at a multiple of 0x8000 is 0 in a 2 byte entry,
+            // the walk carries on over it
+            store->initializeEEPROM();
+            store->setMileage(0x7ff0);
+            for (int i=0; i<2; ++i)
+            {
+                store->addMileage(8);
+                store->writeMileage();
+            }
+            h = store->history();
+            TS_ASSERT_EQUALS( h.mileage(), 0x8000 );
+            TS_ASSERT( h.first() );
+            TS_ASSERT_EQUALS( h.mileage(), 0x7ff0 );
+            TS_ASSERT_EQUALS( h.back(), 2 );
+            store->addMileage(1);
+            store->writeMileage();
+            h = store->history();
+            for (int i=0; i<3; ++i)
+                TS_ASSERT( h.prev() );
+            TS_ASSERT_EQUALS( h.mileage(), 0x7ff0 );
+            TS_ASSERT( !h.prev() );
+            TS_ASSERT( h.next() );
+            TS_ASSERT_EQUALS( h.mileage(), 0x7ff8 );
+            TS_ASSERT( h.next() );
+            TS_ASSERT_EQUALS( h.mileage(), 0x8000 );
+        }
+
+    void test_snapshot( void )
+        {
+            // the value array a few entries short of wrapping
+            int entries = (k_end_of_eeprom - k_ring_entry_bytes - k_ring_start
+                           + k_ring_entry_bytes - 1) / k_ring_entry_bytes;
+            EEPROMStore* store = fixture.store();
+            for (int i=1; i<entries - 2; ++i)
+            {
+                store->addMileage(1);
+                store->writeMileage();
+            }
+            MockEEPROM::Snapshot nearly_full = EEPROM.snapshot();
+            MockEEPROM::Snapshot shared = nearly_full;
+
+            // each start from the snapshot wraps the same way, and the
+            // snapshot isn't changed by the writes after it
+            for (int run=0; run<2; ++run)
+            {
+                fixture.restore(shared);
+                store = fixture.store();
+                TS_ASSERT_EQUALS( store->mileage(), entries - 3 );
+                TS_ASSERT_EQUALS( EEPROM.writes[k_ring_start], 0 );
+                store->resetStats();
+                for (int i=0; i<5; ++i)
+                {
+                    store->addMileage(1);
+                    store->writeMileage();
+                }
+                TS_ASSERT_EQUALS( store->stats().ring_wraps, 1 );
+                TS_ASSERT_EQUALS( store->mileage(), entries + 2 );
+                TS_ASSERT( !EEPROM.compare(*nearly_full) );
+            }
+            TS_ASSERT_EQUALS( nearly_full.use_count(), 2 );
+
+            MockEEPROM other(EEPROM.len + 1);
+            bool thrown = false;
+            try
+            {
+                other.restore(nearly_full);
+            }
+            catch (std::runtime_error&)
+            {
+                thrown = true;
+            }
+            TS_ASSERT( thrown );
+        }
+
+    void test_backup( void )
+        {
+            EEPROMStore* store = fixture.store();
+            store->setContrast(7);
+            store->setMileage(1234);
+            std::vector<byte> image = EEPROM.mem;
+
+            MockStream port;
+            EEPROMBackup backup(port);
+            byte info[] = { 0 };
+            port.frame(BACKUP_INFO, info, 0);
+            TS_ASSERT( !backup.service() );
+            TS_ASSERT_EQUALS( port.tx.size(), 6 + k_backup_frame_overhead );
+            TS_ASSERT_EQUALS( port.tx[1], BACKUP_INFO );
+            TS_ASSERT_EQUALS( port.tx[3] | (port.tx[4] << 8), EEPROM.length() );
+            TS_ASSERT_EQUALS( port.tx[5], k_backup_block_bytes );
+            TS_ASSERT_EQUALS( port.tx[8], k_eeprom_version );
+
+            // a block CRC matches the one of its bytes
+            port.tx.clear();
+            byte sums[] = { 0, 0, 2 };
+            port.frame(BACKUP_SUMS, sums, 3);
+            backup.service();
+            TS_ASSERT_EQUALS( port.tx.size(), 3 + 2 * 2 + k_backup_frame_overhead );
+            word crc = 0xffff;
+            for (byte i=0; i<k_backup_block_bytes; ++i)
+                crc = backupCrc(crc, image[i]);
+            TS_ASSERT_EQUALS( port.tx[6] | (port.tx[7] << 8), crc );
+
+            // restore the first block after a change, only the changed
+            // bytes are written
+            store->setContrast(9);
+            EEPROM.writes.assign(EEPROM.len, 0);
+            port.tx.clear();
+            byte block[2 + k_backup_block_bytes] = { 0, 0 };
+            memcpy(block + 2, &image[0], k_backup_block_bytes);
+            port.frame(BACKUP_WRITE, block, sizeof(block));
+            bool written = backup.service();
+            TS_ASSERT_EQUALS( port.tx[1], BACKUP_WRITE );
+            unsigned long writes = 0;
+            for (size_t i=0; i<EEPROM.len; ++i)
+                writes += EEPROM.writes[i];
+            TS_ASSERT_EQUALS( writes, port.tx[5] );
+            TS_ASSERT_EQUALS( written, writes > 0 );
+            TS_ASSERT( memcmp(&EEPROM.mem[0], &image[0], k_backup_block_bytes) == 0 );
+
+            // a second time writes nothing
+            port.tx.clear();
+            port.frame(BACKUP_WRITE, block, sizeof(block));
+            TS_ASSERT( !backup.service() );
+            TS_ASSERT_EQUALS( port.tx[5], 0 );
+
+            // a bad CRC or block is answered with an error
+            port.tx.clear();
+            port.frame(BACKUP_READ, block, 2);
+            port.rx[4] ^= 1;
+            backup.service();
+            TS_ASSERT_EQUALS( port.tx[1], BACKUP_ERROR );
+            TS_ASSERT_EQUALS( port.tx[3], BACKUP_BAD_FRAME );
+            port.tx.clear();
+            byte far[] = { 0xff, 0x7f };
+            port.frame(BACKUP_READ, far, 2);
+            backup.service();
+            TS_ASSERT_EQUALS( port.tx[1], BACKUP_ERROR );
+            TS_ASSERT_EQUALS( port.tx[3], BACKUP_BAD_BLOCK );
+
+            // noise ahead of a frame is skipped
+            port.tx.clear();
+            port.rx.push_back(0x55);
+            port.frame(BACKUP_READ, block, 2);
+            backup.service();
+            TS_ASSERT_EQUALS( port.tx.size(), 2 + k_backup_block_bytes + k_backup_frame_overhead );
+            TS_ASSERT_EQUALS( port.tx[1], BACKUP_READ );
+            TS_ASSERT_EQUALS( port.tx[5], image[0] );
+        }
+
+    void test_log_record( void )
+        {
+#if defined(EEPROMSTORE_BINARY_LOG)
+            while (StoreLog.available())
+                StoreLog.read();
+
+            LogArg args[] = { LogArg(0x12345678UL), LogArg(-2), LogArg(1.0f) };
+            StoreLog.record(LOG_WRITE_VALUE, args, 3);
+            TS_ASSERT_EQUALS( StoreLog.available(), 13 );
+            byte expect[] = { LOG_WRITE_VALUE, 0x78, 0x56, 0x34, 0x12,
+                              0xfe, 0xff, 0xff, 0xff, 0x00, 0x00, 0x80, 0x3f };
+            for (size_t i=0; i<sizeof(expect); ++i)
+                TS_ASSERT_EQUALS( StoreLog.read(), expect[i] );
+
+            // records that don't fit are dropped whole
+            unsigned long dropped = StoreLog.dropped();
+            const int fit = (EEPROMLog::k_buffer_size - 1) / 13;
+            for (int i=0; i<=fit; ++i)
+                StoreLog.record(LOG_WRITE_VALUE, args, 3);
+            TS_ASSERT_EQUALS( StoreLog.available(), fit * 13 );
+            TS_ASSERT_EQUALS( StoreLog.dropped(), dropped + 1 );
+
+            // a drain sends what fits in the transmit buffer
+            StoreLog.drain();
+            TS_ASSERT_EQUALS( StoreLog.available(), fit * 13 - 63 );
+            StoreLog.drain();
+            TS_ASSERT_EQUALS( StoreLog.available(), 0 );
+#else
+            // text is printed as it is logged, there is no buffer
+            TS_ASSERT_EQUALS( sizeof(EEPROMLog), 1 );
+            TS_ASSERT_EQUALS( StoreLog.dropped(), 0 );
+#endif
         }
     
 };
@@ -3,9 +3,12 @@
 
 #include <iostream>
 #include <iomanip>
+#include <cstdint>
 
 enum INT_FORMAT {DEC, HEX};
 
+class __FlashStringHelper;
+
 class MockSerial
 {
     std::ostream& os;
@@ -18,12 +21,29 @@ public:
 
     static void begin();
     static void end();
+
+    // the mock never blocks, pretend the transmit buffer is empty
+    int availableForWrite()
+        {
+            return 63;
+        }
+
+    size_t write(uint8_t b)
+        {
+            os.put(b);
+            return 1;
+        }
     
     void print(const char* msg)
         {
             os << msg;
         }
 
+    void print(const __FlashStringHelper* msg)
+        {
+            os << reinterpret_cast<const char*>(msg);
+        }
+
     void print(int num, INT_FORMAT fmt = DEC)
         {
             if (fmt == DEC)
@@ -32,21 +52,54 @@ public:
                 os << std::hex << num;
         }
     
+    void print(long num, INT_FORMAT fmt = DEC)
+        {
+            if (fmt == DEC)
+                os << std::dec << num;
+            else if (fmt == HEX)
+                os << std::hex << num;
+        }
+
+    void print(unsigned long num, INT_FORMAT fmt = DEC)
+        {
+            if (fmt == DEC)
+                os << std::dec << num;
+            else if (fmt == HEX)
+                os << std::hex << num;
+        }
+    
     void print(float num, int places)
         {
             os << std::fixed << std::setprecision(places) << num;
         }
     
+    void println()
+        {
+            os << std::endl; 
+        }
+
     void println(const char* msg)
         {
             os << msg << std::endl; 
         }
 
+    void println(const __FlashStringHelper* msg)
+        {
+            print(msg);
+            os << std::endl; 
+        }
+
     void println(int num, INT_FORMAT fmt = DEC)
         {
             print(num, fmt);
             os << std::endl; 
         }
+
+    void println(unsigned long num, INT_FORMAT fmt = DEC)
+        {
+            print(num, fmt);
+            os << std::endl; 
+        }
     
 };
 
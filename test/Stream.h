@@ -0,0 +1,20 @@
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include <cstdint>
+#include <cstddef>
+
+// the part of the Arduino Stream used by the library
+class Stream
+{
+public:
+    virtual ~Stream()
+        {
+        }
+
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual size_t write(uint8_t b) = 0;
+};
+
+#endif
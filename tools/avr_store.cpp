@@ -0,0 +1,14 @@
+//============================================================================
+// Name        : avr_store.cpp
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : One store, as a sketch has, for the target size report
+//============================================================================
+
+// Built only by 'make size', with avr-gcc against the Arduino core, so
+// that the store object itself is in the RAM used by the library.
+
+#include "EEPROMStore.h"
+
+EEPROMStore Store;
@@ -0,0 +1,461 @@
+//============================================================================
+// Name        : eeprom_backup.cpp
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : Back up and restore a unit's EEPROM over its serial port
+//============================================================================
+
+// usage: eeprom_backup [-b baud] device backup|restore image
+//        eeprom_backup -l unit_image backup|restore image
+//
+// Talks to a sketch that calls EEPROMBackup::service() in its loop, see
+// src/EEPROMBackup.h. backup asks for the CRC of every block and only
+// reads the blocks that aren't blank, the rest of the image is zeros.
+// restore only sends the blocks whose CRC differs from the image, the
+// sketch updates just the bytes that changed, then the CRCs are checked
+// again. The sketch must run begin() again after a restore.
+//
+// With -l there is no unit: the sketch side runs in a thread on a
+// pseudo-terminal, with the mock EEPROM loaded from unit_image (blank
+// if it doesn't exist) and saved back to it at the end. Its EEPROM
+// time is the modeled time of the writes.
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "EEPROMStore.h"
+#include "EEPROMBackup.h"
+
+// time to wait for a reply, a block write takes about 110 ms
+const int k_reply_ms = 500;
+
+// tries at the first request, a unit restarts when the port is opened
+const int k_info_tries = 10;
+
+// tries at the others
+const int k_tries = 3;
+
+// a file descriptor as a Stream, for the sketch side of the loopback
+class FdStream : public Stream
+{
+public:
+    explicit FdStream(int fd) : _fd(fd)
+        {
+        }
+
+    int available()
+        {
+            int n = 0;
+            if (ioctl(_fd, FIONREAD, &n) < 0)
+                return 0;
+            return n;
+        }
+
+    int read()
+        {
+            byte b;
+            return (::read(_fd, &b, 1) == 1) ? b : -1;
+        }
+
+    size_t write(uint8_t b)
+        {
+            return (::write(_fd, &b, 1) == 1) ? 1 : 0;
+        }
+
+private:
+    int _fd;
+};
+
+// the sketch side of the loopback
+class Loopback
+{
+public:
+    Loopback() : _master(-1), _stop(false)
+        {
+        }
+
+    // open the pseudo-terminal, returns the name of the device to use
+    const char* open(const char* image)
+        {
+            _image = image;
+            FILE* f = fopen(image, "rb");
+            if (f)
+            {
+                size_t n = fread(&EEPROM.mem[0], 1, EEPROM.len, f);
+                fclose(f);
+                if (n != EEPROM.len)
+                {
+                    fprintf(stderr, "%s: not %zu bytes\n", image, EEPROM.len);
+                    return 0;
+                }
+            }
+            _master = posix_openpt(O_RDWR | O_NOCTTY);
+            if (_master < 0 || grantpt(_master) < 0 || unlockpt(_master) < 0)
+            {
+                perror("pseudo-terminal");
+                return 0;
+            }
+            const char* name = ptsname(_master);
+            // raw before the other side opens it
+            int slave = ::open(name, O_RDWR | O_NOCTTY);
+            struct termios tio;
+            if (slave < 0 || tcgetattr(slave, &tio) < 0)
+            {
+                perror(name);
+                return 0;
+            }
+            cfmakeraw(&tio);
+            tcsetattr(slave, TCSANOW, &tio);
+            ::close(slave);
+            _start_us = micros();
+            _thread = std::thread(&Loopback::run, this);
+            return name;
+        }
+
+    // stop the sketch, save the image, returns false if that failed
+    bool close()
+        {
+            if (_master < 0)
+                return true;
+            _stop = true;
+            if (_thread.joinable())
+                _thread.join();
+            ::close(_master);
+            _master = -1;
+            FILE* f = fopen(_image, "wb");
+            if (f == 0 || fwrite(&EEPROM.mem[0], 1, EEPROM.len, f) != EEPROM.len)
+            {
+                perror(_image);
+                if (f)
+                    fclose(f);
+                return false;
+            }
+            fclose(f);
+            printf("unit eeprom time %lu ms\n", (micros() - _start_us) / 1000);
+            return true;
+        }
+
+private:
+    void run()
+        {
+            FdStream port(_master);
+            EEPROMBackup backup(port);
+            while (!_stop)
+            {
+                struct pollfd pfd = { _master, POLLIN, 0 };
+                poll(&pfd, 1, 10);
+                backup.service();
+            }
+        }
+
+    const char* _image;
+    int _master;
+    std::atomic<bool> _stop;
+    std::thread _thread;
+    unsigned long _start_us;
+};
+
+static int port_fd = -1;
+
+static speed_t baudRate(int baud)
+{
+    switch (baud)
+    {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    default: return 0;
+    }
+}
+
+static bool openPort(const char* device, int baud)
+{
+    port_fd = open(device, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (port_fd < 0 || tcgetattr(port_fd, &tio) < 0)
+    {
+        perror(device);
+        return false;
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, baudRate(baud));
+    cfsetospeed(&tio, baudRate(baud));
+    if (tcsetattr(port_fd, TCSANOW, &tio) < 0)
+    {
+        perror(device);
+        return false;
+    }
+    tcflush(port_fd, TCIOFLUSH);
+    return true;
+}
+
+// next byte from the port, false if none within k_reply_ms
+static bool readByte(byte& b)
+{
+    struct pollfd pfd = { port_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, k_reply_ms) <= 0)
+        return false;
+    return read(port_fd, &b, 1) == 1;
+}
+
+// send a request and wait for its reply, returns false if there was
+// none, or it was an error
+static bool request(byte cmd, const byte* payload, byte len,
+                    std::vector<byte>& reply, int tries = k_tries)
+{
+    byte frame[k_backup_frame_overhead + 255];
+    word crc = backupCrc(backupCrc(0xffff, cmd), len);
+    frame[0] = k_backup_sync;
+    frame[1] = cmd;
+    frame[2] = len;
+    for (byte i=0; i<len; ++i)
+    {
+        frame[3 + i] = payload[i];
+        crc = backupCrc(crc, payload[i]);
+    }
+    frame[3 + len] = crc & 0xff;
+    frame[4 + len] = crc >> 8;
+
+    for (int t=0; t<tries; ++t)
+    {
+        if (write(port_fd, frame, len + k_backup_frame_overhead) != len + k_backup_frame_overhead)
+        {
+            perror("write");
+            return false;
+        }
+        byte b;
+        bool ok;
+        while ((ok = readByte(b)) && b != k_backup_sync)
+            ;
+        byte rcmd, rlen;
+        if (!ok || !readByte(rcmd) || !readByte(rlen))
+            continue;
+        reply.resize(rlen);
+        crc = backupCrc(backupCrc(0xffff, rcmd), rlen);
+        for (byte i=0; ok && i<rlen; ++i)
+        {
+            ok = readByte(reply[i]);
+            crc = backupCrc(crc, reply[i]);
+        }
+        byte lo, hi;
+        if (!ok || !readByte(lo) || !readByte(hi) || (lo | (hi << 8)) != crc)
+            continue;
+        if (rcmd == BACKUP_ERROR)
+        {
+            fprintf(stderr, "unit error %d for '%c'\n", rlen ? reply[0] : 0, cmd);
+            if (rlen == 1 && reply[0] == BACKUP_BAD_FRAME)
+                continue;
+            return false;
+        }
+        if (rcmd == cmd)
+            return true;
+    }
+    fprintf(stderr, "no reply to '%c'\n", cmd);
+    return false;
+}
+
+static word getWord(const std::vector<byte>& v, int off)
+{
+    return v[off] | (v[off + 1] << 8);
+}
+
+// CRC of every block on the unit
+static bool unitSums(int blocks, std::vector<word>& sums)
+{
+    sums.clear();
+    for (int first=0; first<blocks; first+=k_backup_max_sums)
+    {
+        int count = blocks - first;
+        if (count > k_backup_max_sums)
+            count = k_backup_max_sums;
+        byte req[] = { static_cast<byte>(first & 0xff),
+                       static_cast<byte>(first >> 8), static_cast<byte>(count) };
+        std::vector<byte> reply;
+        if (!request(BACKUP_SUMS, req, sizeof(req), reply)
+            || reply.size() != 3u + 2 * count)
+            return false;
+        for (int i=0; i<count; ++i)
+            sums.push_back(getWord(reply, 3 + 2 * i));
+    }
+    return true;
+}
+
+static word blockCrc(const byte* p)
+{
+    word crc = 0xffff;
+    for (byte i=0; i<k_backup_block_bytes; ++i)
+        crc = backupCrc(crc, p[i]);
+    return crc;
+}
+
+static double elapsedMs(const struct timeval& start)
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+    return (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_usec - start.tv_usec) / 1000.0;
+}
+
+static int backup(int length, int blocks, const char* path)
+{
+    std::vector<word> sums;
+    if (!unitSums(blocks, sums))
+        return 1;
+    std::vector<byte> image(blocks * k_backup_block_bytes, 0);
+    word blank = blockCrc(&image[0]);
+    int read = 0;
+    for (int b=0; b<blocks; ++b)
+    {
+        if (sums[b] == blank)
+            continue;
+        byte req[] = { static_cast<byte>(b & 0xff), static_cast<byte>(b >> 8) };
+        std::vector<byte> reply;
+        if (!request(BACKUP_READ, req, sizeof(req), reply)
+            || reply.size() != 2u + k_backup_block_bytes
+            || getWord(reply, 0) != b)
+            return 1;
+        if (blockCrc(&reply[2]) != sums[b])
+        {
+            fprintf(stderr, "block %d changed during the backup\n", b);
+            return 1;
+        }
+        memcpy(&image[b * k_backup_block_bytes], &reply[2], k_backup_block_bytes);
+        ++read;
+    }
+    FILE* f = fopen(path, "wb");
+    if (f == 0 || fwrite(&image[0], 1, length, f) != static_cast<size_t>(length))
+    {
+        perror(path);
+        if (f)
+            fclose(f);
+        return 1;
+    }
+    fclose(f);
+    printf("read %d of %d blocks, %d bytes\n", read, blocks, read * k_backup_block_bytes);
+    return 0;
+}
+
+static int restore(int length, int blocks, const char* path)
+{
+    std::vector<byte> image(blocks * k_backup_block_bytes, 0);
+    FILE* f = fopen(path, "rb");
+    if (f == 0)
+    {
+        perror(path);
+        return 1;
+    }
+    size_t n = fread(&image[0], 1, length + 1, f);
+    fclose(f);
+    if (n != static_cast<size_t>(length))
+    {
+        fprintf(stderr, "%s: not %d bytes\n", path, length);
+        return 1;
+    }
+
+    std::vector<word> sums;
+    if (!unitSums(blocks, sums))
+        return 1;
+    int sent = 0;
+    int written = 0;
+    for (int b=0; b<blocks; ++b)
+    {
+        const byte* p = &image[b * k_backup_block_bytes];
+        if (sums[b] == blockCrc(p))
+            continue;
+        byte req[2 + k_backup_block_bytes] = { static_cast<byte>(b & 0xff),
+                                               static_cast<byte>(b >> 8) };
+        memcpy(req + 2, p, k_backup_block_bytes);
+        std::vector<byte> reply;
+        if (!request(BACKUP_WRITE, req, sizeof(req), reply)
+            || reply.size() != 3 || getWord(reply, 0) != b)
+            return 1;
+        ++sent;
+        written += reply[2];
+    }
+
+    // check the unit has the image now
+    if (!unitSums(blocks, sums))
+        return 1;
+    for (int b=0; b<blocks; ++b)
+    {
+        if (sums[b] != blockCrc(&image[b * k_backup_block_bytes]))
+        {
+            fprintf(stderr, "block %d differs after the restore\n", b);
+            return 1;
+        }
+    }
+    printf("sent %d of %d blocks, %d bytes written\n", sent, blocks, written);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int baud = 115200;
+    const char* unit = 0;
+    std::vector<const char*> args;
+    for (int i=1; i<argc; ++i)
+    {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            baud = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            unit = argv[++i];
+        else
+            args.push_back(argv[i]);
+    }
+    if (unit)
+        args.insert(args.begin(), static_cast<const char*>(0));
+    if (args.size() != 3 || baudRate(baud) == 0
+        || (strcmp(args[1], "backup") != 0 && strcmp(args[1], "restore") != 0))
+    {
+        fprintf(stderr, "usage: %s [-b baud] device backup|restore image\n"
+                "       %s -l unit_image backup|restore image\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    Loopback loopback;
+    const char* device = args[0];
+    if (unit && (device = loopback.open(unit)) == 0)
+        return 2;
+    if (!openPort(device, baud))
+    {
+        loopback.close();
+        return 2;
+    }
+
+    struct timeval start;
+    gettimeofday(&start, 0);
+    std::vector<byte> info;
+    int ret = 1;
+    if (request(BACKUP_INFO, 0, 0, info, k_info_tries) && info.size() == 6)
+    {
+        int length = getWord(info, 0);
+        int blocks = (length + info[2] - 1) / info[2];
+        if (info[2] != k_backup_block_bytes)
+            fprintf(stderr, "unit has %d byte blocks\n", info[2]);
+        else if (strcmp(args[1], "backup") == 0)
+            ret = backup(length, blocks, args[2]);
+        else
+            ret = restore(length, blocks, args[2]);
+        if (ret == 0)
+            printf("eeprom %d bytes, value array at %d, version %d, %.0f ms\n",
+                   length, getWord(info, 3), info[5], elapsedMs(start));
+    }
+    close(port_fd);
+    if (!loopback.close())
+        ret = 1;
+    return ret;
+}
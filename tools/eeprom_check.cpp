@@ -0,0 +1,434 @@
+//============================================================================
+// Name        : eeprom_check.cpp
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : Check raw EEPROM images pulled from units
+//============================================================================
+
+// usage: eeprom_check [--csv] [-j threads] image...
+//
+// Each image is mapped read only and decoded in place with the same
+// EEPROMLayout functions the store uses. The images are spread over
+// all cores, one line of JSON (or CSV) is printed per image in the
+// order given, followed by a summary.
+//
+// The header and the settings log are packed little endian, so images
+// from AVR and ARM units decode the same, but they must come from a
+// build with the same value array entry width and number of trips.
+// Version 0 images, which begin() moves to the current layout, are
+// decoded as AVR units wrote them, with the mileage and trips the move
+// would give.
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "EEPROMStore.h"
+#include "EEPROMLayout.h"
+
+struct Result
+{
+    std::string path;
+    std::string error;
+    int size;
+    int version;
+    bool header_ok;
+    int markers;
+    bool blank;
+    int latest_offset;
+    unsigned long mileage;
+    int regressions;
+    bool ring_ok;
+    unsigned long trip[EEPROMSTORE_TRIPS];
+    bool trips_ok;
+
+    Result()
+        : size(0), version(0), header_ok(false), markers(0), blank(false),
+          latest_offset(0), mileage(0), regressions(0), ring_ok(false),
+          trips_ok(false)
+        {
+            memset(trip, 0, sizeof(trip));
+        }
+
+    bool ok() const
+        {
+            return error.empty() && header_ok && (markers == 1 || blank)
+                && ring_ok && trips_ok;
+        }
+};
+
+// true if the latest value of a float setting, if any, is finite
+static bool finiteSetting(const byte* log, const byte* index, byte key)
+{
+    return index[key] == 0 || std::isfinite(Packed<float>::get(log, index[key]));
+}
+
+// offsets in a version 0 image. AVR laid its header out without
+// padding, unlike EEPROMHeaderV0 on the host, and the value array of 2
+// byte entries followed it
+const int k_v0_flags = 1;
+const int k_v0_multiplier = 5;
+const int k_v0_floats[] = { 8, 12, 16 };
+const int k_v0_trips[] = { 20, 23 };
+const int k_v0_ring_start = 26;
+
+// decode a version 0 entry, returns true if it has the end marker
+static bool v0Entry(const byte* image, int offset, word& val)
+{
+    val = ((image[offset] & 0x7f) << 8) | image[offset + 1];
+    return (image[offset] & 0x80) != 0;
+}
+
+// decode a version 0 image in place, as migrateVersion0 reads it
+static void checkImageV0(const byte* image, int size, Result& r)
+{
+    const int start = k_v0_ring_start;
+    const int last = start + ((size - start) / 2 - 1) * 2;
+    r.header_ok = (image[k_v0_flags] & ~METRIC_FLAG) == 0;
+    for (size_t i=0; i<sizeof(k_v0_floats)/sizeof(k_v0_floats[0]); ++i)
+        if (!std::isfinite(Packed<float>::get(image, k_v0_floats[i])))
+            r.header_ok = false;
+
+    word val;
+    r.markers = 0;
+    r.latest_offset = 0;
+    for (int off = start; off <= last; off += 2)
+    {
+        if (v0Entry(image, off, val))
+        {
+            if (r.markers++ == 0)
+                r.latest_offset = off;
+        }
+    }
+    r.blank = true;
+    for (int i = 0; i < size; ++i)
+    {
+        if (image[i] != 0)
+            r.blank = false;
+    }
+
+    // the multiplier in the header is the one of the latest entry
+    byte mult = image[k_v0_multiplier];
+    val = 0;
+    if (r.markers > 0)
+        v0Entry(image, r.latest_offset, val);
+    else
+        r.latest_offset = start;
+    unsigned long mileage = mult * k_v0_step + val;
+    r.mileage = mileage % k_mileage_rollover;
+
+    // walking back, as for the current layout, an entry not below the one
+    // after it was written with the multiplier one less
+    r.regressions = 0;
+    if (r.markers > 0)
+    {
+        unsigned long newer = mileage;
+        for (int off = (r.latest_offset == start) ? last : r.latest_offset - 2;
+             off != r.latest_offset; off = (off == start) ? last : off - 2)
+        {
+            v0Entry(image, off, val);
+            unsigned long m = mult * k_v0_step + val;
+            if (val == 0 && (mult == 0 || m >= newer))
+                break;
+            if (m >= newer && mult > 0)
+                m = --mult * k_v0_step + val;
+            if (m >= newer)
+                ++r.regressions;
+            newer = m;
+        }
+    }
+    r.ring_ok = r.regressions <= 1;
+
+    // version 0 had two trips and no rollover, the others start at 0
+    r.trips_ok = true;
+    for (int n=0; n<EEPROMSTORE_TRIPS; ++n)
+    {
+        unsigned long marker = mileage;
+        if (n < 2)
+            marker = image[k_v0_trips[n]] * k_v0_step
+                + Packed<word>::get(image, k_v0_trips[n] + 1);
+        if (marker > mileage)
+            r.trips_ok = false;
+        r.trip[n] = tripDistance(r.mileage, marker % k_mileage_rollover);
+    }
+}
+
+// decode one image in place
+static void checkImage(const byte* image, int size, Result& r)
+{
+    const int start = k_ring_start;
+    r.version = image[offsetof(EEPROMHeader, version)];
+    if (r.version == 0 && size >= k_v0_ring_start + 4)
+    {
+        checkImageV0(image, size, r);
+        return;
+    }
+    if (size < start + 4)
+    {
+        r.error = "image too small";
+        return;
+    }
+
+    byte slot = Packed<byte>::get(image, offsetof(EEPROMHeader, multiplier_slot));
+    int m = multiplierOffset(slot);
+    byte multiplier = Packed<byte>::get(image, m + offsetof(EEPROMMultiplier, multiplier));
+    int from = Packed<word>::get(image, m + offsetof(EEPROMMultiplier, from));
+    const byte* log = image + k_settings_start;
+    byte index[KEY_COUNT];
+    scanSettings(log, 0, index);
+    byte flags = index[KEY_FLAGS] ? log[index[KEY_FLAGS]] : 0;
+    r.header_ok = r.version == k_eeprom_version && slot <= 1
+        && (flags & ~METRIC_FLAG) == 0
+        && finiteSetting(log, index, KEY_VOLTAGE_OFFSET)
+        && finiteSetting(log, index, KEY_VOLTAGE_CORRECTION)
+        && finiteSetting(log, index, KEY_SPEEDO_CORRECTION);
+
+    // a blank array has no marker at all, every byte is 0, anything else
+    // exactly one
+    RingValue val;
+    r.markers = 0;
+    for (int off = start; off + k_ring_entry_bytes <= size; off += k_ring_entry_bytes)
+    {
+        if (ringEntry(image, off, val))
+            ++r.markers;
+    }
+    r.blank = true;
+    for (int i = start; i < size; ++i)
+    {
+        if (image[i] != 0)
+            r.blank = false;
+    }
+
+    bool found = scanRing(image, start, size, r.latest_offset, val);
+    if (!found)
+        r.latest_offset = start;
+    else
+        multiplier = latestMultiplier(image, start, size, r.latest_offset,
+                                      multiplier, from);
+    r.mileage = ringMileage(multiplier, val);
+
+    // walking back from the latest entry the mileage only goes down, as
+    // in RingHistory::prev. With 2 byte entries a value not below the one
+    // after it was written with the multiplier one less, while there is
+    // one. A blank entry ends the values, anything else out of order is a
+    // regression, where the mileage was set back
+    r.regressions = 0;
+    if (found)
+    {
+        byte mult = multiplier;
+        unsigned long newer = r.mileage;
+        for (int off = ringPrev(r.latest_offset, start, size);
+             off != r.latest_offset; off = ringPrev(off, start, size))
+        {
+            ringEntry(image, off, val);
+            unsigned long mileage = ringMileage(mult, val);
+            if (val == 0 && (mult == 0 || mileage >= newer))
+                break;
+#if EEPROMSTORE_RING_ENTRY_BYTES == 2
+            if (mileage >= newer && mult > 0)
+                mileage = ringMileage(--mult, val);
+#endif
+            if (mileage >= newer)
+                ++r.regressions;
+            newer = mileage;
+        }
+    }
+    r.ring_ok = r.regressions <= 1;
+
+    r.trips_ok = true;
+    for (int n=0; n<EEPROMSTORE_TRIPS; ++n)
+    {
+        byte key = KEY_TRIP + n;
+        unsigned long marker = index[key] ? tripMarker(log, index[key]) : 0;
+        // a marker above the mileage was set before it rolled over, one
+        // at or above the rollover can't have been set
+        r.trip[n] = tripDistance(r.mileage, marker);
+        if (marker >= k_mileage_rollover)
+            r.trips_ok = false;
+    }
+}
+
+static void checkFile(Result& r)
+{
+    int fd = open(r.path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        r.error = strerror(errno);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        r.error = "empty image";
+        close(fd);
+        return;
+    }
+    r.size = st.st_size;
+    void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        r.error = strerror(errno);
+        return;
+    }
+    checkImage(static_cast<const byte*>(p), r.size, r);
+    munmap(p, st.st_size);
+}
+
+// a string as a JSON string, quoted, with quotes, backslashes and
+// control characters escaped
+static std::string jsonString(const std::string& s)
+{
+    std::string out = "\"";
+    for (size_t i=0; i<s.size(); ++i)
+    {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c < 0x20)
+        {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        }
+        else
+            out += c;
+    }
+    return out + "\"";
+}
+
+// a string as a CSV field, quoted if it has a comma, quote or line
+// break, with the quotes doubled
+static std::string csvField(const std::string& s)
+{
+    if (s.find_first_of(",\"\r\n") == std::string::npos)
+        return s;
+    std::string out = "\"";
+    for (size_t i=0; i<s.size(); ++i)
+    {
+        if (s[i] == '"')
+            out += '"';
+        out += s[i];
+    }
+    return out + "\"";
+}
+
+static void printJSON(const Result& r)
+{
+    printf("{\"image\":%s,\"ok\":%s", jsonString(r.path).c_str(),
+           r.ok() ? "true" : "false");
+    if (!r.error.empty())
+    {
+        printf(",\"error\":%s}\n", jsonString(r.error).c_str());
+        return;
+    }
+    printf(",\"size\":%d,\"version\":%d,\"header_ok\":%s,\"markers\":%d,\"blank\":%s"
+           ",\"latest_offset\":%d,\"mileage\":%lu,\"regressions\":%d"
+           ",\"ring_ok\":%s,\"trips\":[",
+           r.size, r.version, r.header_ok ? "true" : "false", r.markers,
+           r.blank ? "true" : "false", r.latest_offset, r.mileage,
+           r.regressions, r.ring_ok ? "true" : "false");
+    for (int n=0; n<EEPROMSTORE_TRIPS; ++n)
+        printf(n ? ",%lu" : "%lu", r.trip[n]);
+    printf("],\"trips_ok\":%s}\n", r.trips_ok ? "true" : "false");
+}
+
+static void printCSV(const Result& r)
+{
+    printf("%s,%d,%s,%d,%d,%d,%d,%d,%d,%lu,%d,%d,", csvField(r.path).c_str(),
+           r.ok(), csvField(r.error).c_str(), r.size, r.version, r.header_ok,
+           r.markers,
+           r.blank, r.latest_offset, r.mileage, r.regressions, r.ring_ok);
+    for (int n=0; n<EEPROMSTORE_TRIPS; ++n)
+        printf("%lu,", r.trip[n]);
+    printf("%d\n", r.trips_ok);
+}
+
+int main(int argc, char** argv)
+{
+    bool csv = false;
+    unsigned threads = std::thread::hardware_concurrency();
+    std::vector<Result> results;
+    for (int i=1; i<argc; ++i)
+    {
+        if (strcmp(argv[i], "--csv") == 0)
+            csv = true;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            char* end;
+            long n = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || n < 1 || n > 1024)
+            {
+                fprintf(stderr, "%s: -j takes a number of threads from 1 to 1024\n",
+                        argv[0]);
+                return 2;
+            }
+            threads = n;
+        }
+        else
+        {
+            results.push_back(Result());
+            results.back().path = argv[i];
+        }
+    }
+    if (results.empty())
+    {
+        fprintf(stderr, "usage: %s [--csv] [-j threads] image...\n", argv[0]);
+        return 2;
+    }
+    // hardware_concurrency is 0 when it isn't known
+    if (threads == 0)
+        threads = 1;
+
+    // each worker takes the next unchecked image
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned t=0; t<threads; ++t)
+        workers.push_back(std::thread([&]() {
+                    size_t i;
+                    while ((i = next++) < results.size())
+                        checkFile(results[i]);
+                }));
+    for (size_t t=0; t<workers.size(); ++t)
+        workers[t].join();
+
+    size_t bad = 0;
+    if (csv)
+    {
+        printf("image,ok,error,size,version,header_ok,markers,blank,latest_offset,"
+               "mileage,regressions,ring_ok,");
+        for (int n=0; n<EEPROMSTORE_TRIPS; ++n)
+            printf("trip%d,", n + 1);
+        printf("trips_ok\n");
+    }
+    for (size_t i=0; i<results.size(); ++i)
+    {
+        if (!results[i].ok())
+            ++bad;
+        if (csv)
+            printCSV(results[i]);
+        else
+            printJSON(results[i]);
+    }
+    if (csv)
+        fprintf(stderr, "images:%zu failed:%zu\n", results.size(), bad);
+    else
+        printf("{\"images\":%zu,\"failed\":%zu}\n", results.size(), bad);
+    return bad ? 1 : 0;
+}
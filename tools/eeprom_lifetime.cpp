@@ -0,0 +1,271 @@
+//============================================================================
+// Name        : eeprom_lifetime.cpp
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : Simulate years of riding to estimate EEPROM lifetime
+//============================================================================
+
+// usage: eeprom_lifetime [-y years] [-u units] [-r ring_end,...] [-w prefix]
+//                        [-t prefix] [profile...]
+//
+// Drives the store, built against the mock EEPROM, through ride
+// profiles. Every ride is a power cycle: a new store runs begin(), the
+// mileage is added a unit at a time through the write policy
+// (service() every `units`), and flush() at ignition off. Each profile
+// is run for each ring end given, from a blank EEPROM.
+//
+// For each run it prints the value array entry width and the number of
+// entries, which is the number of updates before the array wraps, the
+// writes to the header and settings log, the writes to the hottest cell, the year that
+// cell reaches the rated endurance, and the bytes scanned per boot in
+// the first and last year. Build with ENTRY_BYTES=3 or 4 for the other
+// entry widths. With -w the writes to every cell are saved
+// to prefix_<profile>_<ring end>.csv. With -t the calls into the store
+// are saved to prefix_<profile>_<ring end>.trace, for eeprom_replay.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "EEPROMStore.h"
+
+// end of the value array, in EEPROMStore.cpp
+extern int k_end_of_eeprom;
+
+// rated write endurance of an AVR EEPROM cell
+const unsigned long k_endurance = 100000;
+
+struct Profile
+{
+    const char* name;
+    // rides in a week, and miles in each
+    int rides;
+    int miles;
+    // settings changes and trip resets in a week
+    int settings;
+    int trip_resets;
+};
+
+static const Profile k_profiles[] =
+{
+    { "commute", 10, 15, 0, 1 },
+    { "touring", 4, 250, 0, 4 },
+    { "settings", 10, 15, 14, 7 },
+    { "powercycle", 42, 2, 0, 1 },
+};
+
+static const int k_profile_count = sizeof(k_profiles) / sizeof(k_profiles[0]);
+
+// the trace of the current run, if one is saved
+static FILE* trace_file = 0;
+
+static void saveTrace(const byte* record, byte len)
+{
+    fwrite(record, 1, len, trace_file);
+}
+
+struct Run
+{
+    unsigned long rides;
+    unsigned long mileage;
+    int entries;
+    unsigned long total_writes;
+    unsigned long header_writes;
+    unsigned long hottest_writes;
+    int hottest_cell;
+    double endurance_year;
+    unsigned long scan_first;
+    unsigned long scan_last;
+};
+
+// one power cycle of the store
+static unsigned long ride(const Profile& p, int units, int n)
+{
+    EEPROMStore store;
+    if (trace_file)
+        store.setTraceHook(saveTrace);
+    store.begin();
+    unsigned long scanned = store.stats().boot_scan_bytes;
+    store.setWritePolicy(units, 0);
+    // spread the settings changes and trip resets over the week's rides
+    if (n * p.settings / p.rides != (n + 1) * p.settings / p.rides)
+        store.setContrast(store.contrast() ^ 1);
+    if (n * p.trip_resets / p.rides != (n + 1) * p.trip_resets / p.rides)
+        store.resetTrip(n % EEPROMSTORE_TRIPS);
+    for (int m=0; m<p.miles; ++m)
+    {
+        store.addMileage(1);
+        store.service();
+    }
+    store.flush();
+    return scanned;
+}
+
+// save the writes to each cell
+static void saveWear(const char* prefix, const Profile& p, int ring_end)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s_%s_%d.csv", prefix, p.name, ring_end);
+    FILE* f = fopen(path, "w");
+    if (f == 0)
+    {
+        perror(path);
+        return;
+    }
+    fprintf(f, "cell,writes\n");
+    for (int i=0; i<ring_end; ++i)
+        fprintf(f, "%d,%lu\n", i, EEPROM.writes[i]);
+    fclose(f);
+}
+
+static Run simulate(const Profile& p, int years, int units, int ring_end,
+                    const char* trace)
+{
+    if (trace)
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "%s_%s_%d.trace", trace, p.name, ring_end);
+        if ((trace_file = fopen(path, "wb")) == 0)
+            perror(path);
+    }
+
+    k_end_of_eeprom = ring_end;
+    EEPROM.reset();
+
+    Run r;
+    memset(&r, 0, sizeof(r));
+    r.endurance_year = -1;
+    unsigned long scan = 0;
+    unsigned long boots = 0;
+    for (int year=0; year<years; ++year)
+    {
+        scan = boots = 0;
+        for (int week=0; week<52; ++week)
+        {
+            for (int n=0; n<p.rides; ++n)
+            {
+                scan += ride(p, units, n);
+                ++boots;
+            }
+        }
+        if (year == 0)
+            r.scan_first = scan / boots;
+        if (r.endurance_year < 0)
+        {
+            for (int i=0; i<ring_end; ++i)
+            {
+                if (EEPROM.writes[i] >= k_endurance)
+                {
+                    r.endurance_year = year + 1;
+                    break;
+                }
+            }
+        }
+    }
+    r.scan_last = scan / boots;
+    r.rides = 52UL * years * p.rides;
+    r.mileage = r.rides * p.miles;
+    const int start = k_ring_start;
+    for (int off=ringNext(start, start, ring_end); off!=start;
+         off=ringNext(off, start, ring_end))
+        ++r.entries;
+    ++r.entries;
+    for (int i=0; i<ring_end; ++i)
+    {
+        r.total_writes += EEPROM.writes[i];
+        if (i < start)
+            r.header_writes += EEPROM.writes[i];
+        if (EEPROM.writes[i] > r.hottest_writes)
+        {
+            r.hottest_writes = EEPROM.writes[i];
+            r.hottest_cell = i;
+        }
+    }
+    if (trace_file)
+    {
+        fclose(trace_file);
+        trace_file = 0;
+    }
+    // extrapolate if the hottest cell didn't wear out in the run
+    if (r.endurance_year < 0 && r.hottest_writes > 0)
+        r.endurance_year = static_cast<double>(years) * k_endurance / r.hottest_writes;
+    return r;
+}
+
+int main(int argc, char** argv)
+{
+    int years = 20;
+    int units = 1;
+    const char* wear = 0;
+    const char* trace = 0;
+    std::vector<int> rings;
+    std::vector<const Profile*> profiles;
+    for (int i=1; i<argc; ++i)
+    {
+        if (strcmp(argv[i], "-y") == 0 && i + 1 < argc)
+            years = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+            units = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            wear = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            trace = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            for (char* s = strtok(argv[++i], ","); s; s = strtok(0, ","))
+                rings.push_back(atoi(s));
+        }
+        else
+        {
+            int p;
+            for (p=0; p<k_profile_count; ++p)
+                if (strcmp(argv[i], k_profiles[p].name) == 0)
+                    break;
+            if (p == k_profile_count)
+            {
+                fprintf(stderr, "usage: %s [-y years] [-u units] [-r ring_end,...]"
+                        " [-w prefix] [-t prefix] [profile...]\nprofiles:", argv[0]);
+                for (p=0; p<k_profile_count; ++p)
+                    fprintf(stderr, " %s", k_profiles[p].name);
+                fprintf(stderr, "\n");
+                return 2;
+            }
+            profiles.push_back(&k_profiles[p]);
+        }
+    }
+    if (rings.empty())
+        rings.push_back(EEPROM.length());
+    if (profiles.empty())
+        for (int p=0; p<k_profile_count; ++p)
+            profiles.push_back(&k_profiles[p]);
+    for (size_t i=0; i<rings.size(); ++i)
+    {
+        if (rings[i] <= k_ring_start + 4
+            || rings[i] > EEPROM.length())
+        {
+            fprintf(stderr, "ring end %d out of range\n", rings[i]);
+            return 2;
+        }
+    }
+
+    printf("%-10s %5s %5s %7s %6s %9s %10s %8s %10s %5s %9s %9s %9s\n",
+           "profile", "ring", "entry", "entries", "units", "mileage", "writes",
+           "header", "hottest", "cell", "worn out", "scan yr1", "scan end");
+    for (size_t p=0; p<profiles.size(); ++p)
+    {
+        for (size_t i=0; i<rings.size(); ++i)
+        {
+            Run r = simulate(*profiles[p], years, units, rings[i], trace);
+            printf("%-10s %5d %5d %7d %6d %9lu %10lu %8lu %10lu %5d %8.1fy"
+                   " %9lu %9lu\n", profiles[p]->name, rings[i],
+                   k_ring_entry_bytes, r.entries, units, r.mileage,
+                   r.total_writes, r.header_writes, r.hottest_writes,
+                   r.hottest_cell, r.endurance_year, r.scan_first, r.scan_last);
+            if (wear)
+                saveWear(wear, *profiles[p], rings[i]);
+        }
+    }
+    return 0;
+}
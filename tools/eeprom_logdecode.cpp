@@ -0,0 +1,86 @@
+//============================================================================
+// Name        : eeprom_logdecode.cpp
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : Turn binary log records of the store back into text
+//============================================================================
+
+// usage: eeprom_logdecode [file]
+//
+// Reads the records written by a build with EEPROMSTORE_BINARY_LOG from
+// the file, or standard input, and prints each as the text the store
+// would have printed. The formats come from the table in EEPROMLog.h.
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+
+#include "EEPROMLog.h"
+
+#define EEPROMSTORE_LOG_FORMAT(id, fmt) fmt,
+static const char* const k_log_formats[] =
+{
+    EEPROMSTORE_LOG_MESSAGES(EEPROMSTORE_LOG_FORMAT)
+};
+#undef EEPROMSTORE_LOG_FORMAT
+
+// read a 4 byte little endian argument
+static bool readArg(FILE* in, uint32_t& v)
+{
+    byte b[4];
+    if (fread(b, 1, 4, in) != 4)
+        return false;
+    v = b[0] | (b[1] << 8) | (b[2] << 16) | (static_cast<uint32_t>(b[3]) << 24);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    FILE* in = stdin;
+    if (argc > 1 && (in = fopen(argv[1], "rb")) == 0)
+    {
+        perror(argv[1]);
+        return 2;
+    }
+
+    int id;
+    while ((id = fgetc(in)) != EOF)
+    {
+        if (id >= LOG_MESSAGE_COUNT)
+        {
+            fprintf(stderr, "unknown message id %d\n", id);
+            return 1;
+        }
+        for (const char* p = k_log_formats[id]; *p; ++p)
+        {
+            if (*p != '%')
+            {
+                putchar(*p);
+                continue;
+            }
+            uint32_t v;
+            if (!readArg(in, v))
+            {
+                fprintf(stderr, "truncated record\n");
+                return 1;
+            }
+            float f;
+            switch (*++p)
+            {
+            case 'x':
+                printf("%X", v);
+                break;
+            case 'f':
+                memcpy(&f, &v, 4);
+                printf("%.6f", f);
+                break;
+            default:
+                printf("%d", static_cast<int32_t>(v));
+                break;
+            }
+        }
+        putchar('\n');
+    }
+    return 0;
+}
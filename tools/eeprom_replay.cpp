@@ -0,0 +1,473 @@
+//============================================================================
+// Name        : eeprom_replay.cpp
+// Author      : Greg Green <gpgreen@gmail.com>
+// Version     : 1.0
+// Copyright   : GPL v3
+// Description : Replay traces of calls into the store against EEPROM layouts
+//============================================================================
+
+// usage: eeprom_replay [-r ring_end,...] trace
+//
+// Reads a trace recorded by a build with EEPROMSTORE_TRACE (see
+// EEPROMTrace.h), then plays it against each backend, each on a blank
+// mock EEPROM:
+//
+//   ring:<end>  the store of this build, with the value array ending at
+//               each ring end given, by default the whole EEPROM
+//   fixed       the mileage, settings and trip markers each in their own
+//               cells, updated in place, as the store once did
+//
+// Time in the trace drives the mock clock, so the write policy acts as
+// it did in the recording. For each backend it prints the byte reads and
+// writes, the cells written, the writes to the hottest cell and how far
+// that is over the mean of the cells written, and the modeled time spent
+// in the EEPROM: all of it, and the most taken by a single call. The
+// mileage at the end should be the same for all backends. Build with
+// ENTRY_BYTES=3 or 4 for the other value array entry widths.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "EEPROMStore.h"
+#include "EEPROMTrace.h"
+
+// end of the value array, in EEPROMStore.cpp
+extern int k_end_of_eeprom;
+
+// modeled time of a byte read, the 4 cycle stall and the call around it
+const double k_read_micros = 1.0;
+
+struct TraceOp
+{
+    byte op;
+    unsigned long ms;
+    unsigned long a;
+    unsigned long b;
+};
+
+// decode the records of a trace, returns false if one is bad
+static bool decodeTrace(const byte* p, size_t size, std::vector<TraceOp>& ops)
+{
+    size_t off = 0;
+    while (off < size)
+    {
+        TraceOp t;
+        t.op = p[off];
+        t.a = t.b = 0;
+        if (t.op >= TRACE_OP_COUNT)
+        {
+            fprintf(stderr, "unknown op %d at %zu\n", t.op, off);
+            return false;
+        }
+        size_t start = off++;
+        unsigned long* v[] = { &t.ms, &t.a, &t.b };
+        for (byte i=0; i<=traceArgs(t.op); ++i)
+        {
+            byte n = traceReadVarint(p + off, size - off, *v[i]);
+            if (n == 0)
+            {
+                fprintf(stderr, "truncated record at %zu\n", start);
+                return false;
+            }
+            off += n;
+        }
+        ops.push_back(t);
+    }
+    return true;
+}
+
+class Backend
+{
+public:
+    virtual ~Backend() {}
+    virtual std::string name() = 0;
+
+    // start from a blank EEPROM
+    virtual void reset() = 0;
+
+    virtual void apply(const TraceOp& t) = 0;
+
+    // mileage at the end of the trace
+    virtual unsigned long mileage() = 0;
+};
+
+// the store of this build
+class RingBackend : public Backend
+{
+public:
+    explicit RingBackend(int ring_end) : _ring_end(ring_end), _store(0) {}
+    ~RingBackend() { delete _store; }
+
+    std::string name()
+        {
+            return "ring:" + std::to_string(_ring_end);
+        }
+
+    void reset()
+        {
+            k_end_of_eeprom = _ring_end;
+            delete _store;
+            _store = 0;
+        }
+
+    void apply(const TraceOp& t)
+        {
+            // each begin is a power cycle, with a new store
+            if (_store == 0 || t.op == TRACE_BEGIN)
+            {
+                delete _store;
+                _store = new EEPROMStore();
+                _store->begin();
+            }
+            switch (t.op)
+            {
+            case TRACE_INITIALIZE:
+                _store->initializeEEPROM();
+                break;
+            case TRACE_ADD_MILEAGE:
+                _store->addMileage(t.a);
+                break;
+            case TRACE_WRITE_MILEAGE:
+                _store->writeMileage();
+                break;
+            case TRACE_SERVICE:
+                _store->service();
+                break;
+            case TRACE_FLUSH:
+                _store->flush();
+                break;
+            case TRACE_SET_MILEAGE:
+                _store->setMileage(t.a);
+                break;
+            case TRACE_SET_WRITE_POLICY:
+                _store->setWritePolicy(t.a, t.b);
+                break;
+            case TRACE_SETTING:
+                setting(t.a, t.b);
+                break;
+            case TRACE_RESET_TRIP:
+                if (t.a < EEPROMSTORE_TRIPS)
+                    _store->resetTrip(t.a);
+                break;
+            }
+        }
+
+    unsigned long mileage()
+        {
+            return _store ? _store->mileage() : 0;
+        }
+
+private:
+
+    void setting(unsigned long key, unsigned long v)
+        {
+            float f;
+            uint32_t bits = v;
+            memcpy(&f, &bits, sizeof(f));
+            switch (key)
+            {
+            case KEY_FLAGS:
+                if (v & METRIC_FLAG)
+                    _store->setMetric();
+                else
+                    _store->setImperial();
+                break;
+            case KEY_RPM_RANGE:
+                _store->setRPMRange(v);
+                break;
+            case KEY_CONTRAST:
+                _store->setContrast(v);
+                break;
+            case KEY_BACKLIGHT:
+                _store->setBacklight(v);
+                break;
+            case KEY_VOLTAGE_OFFSET:
+                _store->setVoltageOffset(f);
+                break;
+            case KEY_VOLTAGE_CORRECTION:
+                _store->setVoltageCorrection(f);
+                break;
+            case KEY_SPEEDO_CORRECTION:
+                _store->setSpeedoCorrection(f);
+                break;
+            }
+        }
+
+    int _ring_end;
+    EEPROMStore* _store;
+};
+
+// everything updated in place, the mileage in the first 4 cells, then
+// the settings at fixed offsets, then the trip markers
+class FixedBackend : public Backend
+{
+public:
+    std::string name()
+        {
+            return "fixed";
+        }
+
+    void reset()
+        {
+            _mileage = _written = _units = _ms = _start_ms = 0;
+        }
+
+    void apply(const TraceOp& t)
+        {
+            switch (t.op)
+            {
+            case TRACE_BEGIN:
+                // read back the mileage and all the settings
+                _mileage = 0;
+                for (int i=k_trips_offset + EEPROMSTORE_TRIPS * 4 - 1; i>=0; --i)
+                {
+                    byte b = EEPROM.read(i);
+                    if (i < 4)
+                        _mileage = (_mileage << 8) | b;
+                }
+                _written = _mileage;
+                _units = _ms = 0;
+                _start_ms = millis();
+                break;
+            case TRACE_INITIALIZE:
+                for (int i=0; i<k_trips_offset + EEPROMSTORE_TRIPS * 4; ++i)
+                    EEPROM.write(i, 0);
+                _mileage = _written = 0;
+                break;
+            case TRACE_ADD_MILEAGE:
+                _mileage += t.a;
+                break;
+            case TRACE_WRITE_MILEAGE:
+            case TRACE_FLUSH:
+                writeMileage();
+                break;
+            case TRACE_SERVICE:
+                service();
+                break;
+            case TRACE_SET_MILEAGE:
+                _mileage = t.a;
+                writeMileage();
+                for (int n=0; n<EEPROMSTORE_TRIPS; ++n)
+                    put(k_trips_offset + n * 4, _mileage, 4);
+                break;
+            case TRACE_SET_WRITE_POLICY:
+                _units = t.a;
+                _ms = t.b;
+                _start_ms = millis();
+                break;
+            case TRACE_SETTING:
+                if (t.a < KEY_TRIP)
+                    put(k_settings_offset[t.a], t.b, settingSize(t.a));
+                break;
+            case TRACE_RESET_TRIP:
+                if (t.a < EEPROMSTORE_TRIPS)
+                    put(k_trips_offset + t.a * 4, _mileage, 4);
+                break;
+            }
+        }
+
+    unsigned long mileage()
+        {
+            return _mileage;
+        }
+
+private:
+
+    // offsets of the settings, by key, and of the trip markers
+    static const int k_settings_offset[KEY_TRIP];
+    static const int k_trips_offset = 22;
+
+    // update len bytes at offset with v, little endian
+    void put(int offset, unsigned long v, int len)
+        {
+            for (int i=0; i<len; ++i)
+            {
+                EEPROM.update(offset + i, v & 0xff);
+                v >>= 8;
+            }
+        }
+
+    void writeMileage()
+        {
+            if (_mileage == _written)
+                return;
+            put(0, _mileage, 4);
+            _written = _mileage;
+        }
+
+    // the write policy of EEPROMStore::service
+    void service()
+        {
+            unsigned long now = millis();
+            if (_mileage == _written)
+            {
+                _start_ms = now;
+                return;
+            }
+            if ((_units != 0 && _mileage - _written >= _units)
+                || (_ms != 0 && now - _start_ms >= _ms))
+            {
+                writeMileage();
+                _start_ms = now;
+            }
+        }
+
+    unsigned long _mileage;
+    unsigned long _written;
+    unsigned long _units;
+    unsigned long _ms;
+    unsigned long _start_ms;
+};
+
+const int FixedBackend::k_settings_offset[KEY_TRIP] = { 0, 4, 5, 7, 8, 10, 14, 18 };
+
+struct Result
+{
+    unsigned long reads;
+    unsigned long writes;
+    int cells;
+    unsigned long hottest;
+    double spread;
+    double total_ms;
+    double worst_ms;
+    unsigned long mileage;
+};
+
+// play the trace against a backend on a blank EEPROM
+static Result replay(Backend& backend, const std::vector<TraceOp>& ops)
+{
+    EEPROM.reset();
+    backend.reset();
+    Result r;
+    memset(&r, 0, sizeof(r));
+    // time in the trace, on top of where the mock clock starts
+    unsigned long base = micros();
+    unsigned long long trace_us = 0;
+    double total_us = 0;
+    double worst_us = 0;
+    for (size_t i=0; i<ops.size(); ++i)
+    {
+        trace_us += 1000ULL * ops[i].ms;
+        if (micros() - base < trace_us)
+            mockAdvanceMicros(trace_us - (micros() - base));
+        unsigned long us = micros();
+        unsigned long reads = EEPROM.reads;
+        backend.apply(ops[i]);
+        double op_us = (micros() - us) + (EEPROM.reads - reads) * k_read_micros;
+        total_us += op_us;
+        if (op_us > worst_us)
+            worst_us = op_us;
+    }
+    r.reads = EEPROM.reads;
+    for (int i=0; i<EEPROM.length(); ++i)
+    {
+        unsigned long w = EEPROM.writes[i];
+        r.writes += w;
+        if (w > 0)
+            ++r.cells;
+        if (w > r.hottest)
+            r.hottest = w;
+    }
+    if (r.cells > 0)
+        r.spread = r.hottest / (static_cast<double>(r.writes) / r.cells);
+    r.total_ms = total_us / 1000;
+    r.worst_ms = worst_us / 1000;
+    r.mileage = backend.mileage();
+    return r;
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<int> rings;
+    const char* path = 0;
+    for (int i=1; i<argc; ++i)
+    {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            for (char* s = strtok(argv[++i], ","); s; s = strtok(0, ","))
+                rings.push_back(atoi(s));
+        }
+        else if (path == 0 && argv[i][0] != '-')
+            path = argv[i];
+        else
+        {
+            path = 0;
+            break;
+        }
+    }
+    if (path == 0)
+    {
+        fprintf(stderr, "usage: %s [-r ring_end,...] trace\n", argv[0]);
+        return 2;
+    }
+    if (rings.empty())
+        rings.push_back(EEPROM.length());
+    for (size_t i=0; i<rings.size(); ++i)
+    {
+        if (rings[i] <= k_ring_start + 4 || rings[i] > EEPROM.length())
+        {
+            fprintf(stderr, "ring end %d out of range\n", rings[i]);
+            return 2;
+        }
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return 2;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        perror(path);
+        close(fd);
+        return 2;
+    }
+    std::vector<TraceOp> ops;
+    bool ok = true;
+    if (st.st_size > 0)
+    {
+        void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            perror(path);
+            close(fd);
+            return 2;
+        }
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        ops.reserve(st.st_size / 2);
+        ok = decodeTrace(static_cast<const byte*>(p), st.st_size, ops);
+        munmap(p, st.st_size);
+    }
+    close(fd);
+    if (!ok)
+        return 1;
+
+    std::vector<Backend*> backends;
+    for (size_t i=0; i<rings.size(); ++i)
+        backends.push_back(new RingBackend(rings[i]));
+    backends.push_back(new FixedBackend());
+
+    printf("%zu records, value array entry %d bytes\n", ops.size(), k_ring_entry_bytes);
+    printf("%-10s %10s %10s %6s %9s %7s %11s %9s %9s\n", "backend", "reads",
+           "writes", "cells", "hottest", "spread", "eeprom ms", "worst ms",
+           "mileage");
+    for (size_t i=0; i<backends.size(); ++i)
+    {
+        Result r = replay(*backends[i], ops);
+        printf("%-10s %10lu %10lu %6d %9lu %7.1f %11.1f %9.1f %9lu\n",
+               backends[i]->name().c_str(), r.reads, r.writes, r.cells,
+               r.hottest, r.spread, r.total_ms, r.worst_ms, r.mileage);
+        delete backends[i];
+    }
+    return 0;
+}